@@ -15,25 +15,102 @@
  */
 
 #include <math.h>     // log for thermistor calculation
+#include <algorithm>  // min/max for derating
 
 #include "bq769x0.h"
+#include "bq769x0Log.h"
+#include "bq769x0Soc.h"
+#include "bq769x0CellStats.h"
+#include "bq769x0Trace.h"
 #include "registers.h"
 #include "mbed.h"
 
-const char *byte2char(int x)
+// TS ADC value to table index conversion (2^14 / 2^7 = 128 intervals)
+#define THERMISTOR_TABLE_STEP_BITS 7
+
+#define CC_PERIOD_MS 250    // conversion time of coulomb counter
+#define BOOT_SIGNAL_MS 2    // boot signal pulse width (datasheet: max. 2 ms)
+#define BOOT_TIMEOUT_MS 10  // start-up time of the IC (datasheet: max. 10 ms)
+#define FAULT_CONFIRMATION_MS 250   // SYS_STAT read after clearing a fault
+#define BALANCING_PHASE_MS 60000        // alternation of the sets of balanced cells
+#define BALANCING_HYSTERESIS_MV 5       // cell voltage change until re-evaluation
+#define DERATING_UNITY 1024             // factor of DeratingCurve without derating
+#define DERATING_TEMP_BAND 50           // °C/10, ramp-down inside temperature limits
+#define DERATING_VOLTAGE_BAND 100       // mV, ramp-down inside cell voltage limits
+#define DERATING_SOC_BAND 100           // 0.1 %, ramp-down below 10 % and above 90 % SOC
+#define DERATING_SOC_FACTOR 256         // remaining factor at 0 % and 100 % SOC
+#define RESISTANCE_INITIAL_COVARIANCE 1000.0f   // mOhm^2/A^2, first steps dominate
+
+//----------------------------------------------------------------------------
+// CRC-8 with polynomial x^8 + x^2 + x + 1 (0x07), implementation selected
+// with BQ769X0_CRC_IMPL
+
+#if BQ769X0_CRC_IMPL == BQ769X0_CRC_TABLE
+
+static const uint8_t crc8Table[256] = {
+    0x00, 0x07, 0x0E, 0x09, 0x1C, 0x1B, 0x12, 0x15, 0x38, 0x3F, 0x36, 0x31, 0x24, 0x23, 0x2A, 0x2D,
+    0x70, 0x77, 0x7E, 0x79, 0x6C, 0x6B, 0x62, 0x65, 0x48, 0x4F, 0x46, 0x41, 0x54, 0x53, 0x5A, 0x5D,
+    0xE0, 0xE7, 0xEE, 0xE9, 0xFC, 0xFB, 0xF2, 0xF5, 0xD8, 0xDF, 0xD6, 0xD1, 0xC4, 0xC3, 0xCA, 0xCD,
+    0x90, 0x97, 0x9E, 0x99, 0x8C, 0x8B, 0x82, 0x85, 0xA8, 0xAF, 0xA6, 0xA1, 0xB4, 0xB3, 0xBA, 0xBD,
+    0xC7, 0xC0, 0xC9, 0xCE, 0xDB, 0xDC, 0xD5, 0xD2, 0xFF, 0xF8, 0xF1, 0xF6, 0xE3, 0xE4, 0xED, 0xEA,
+    0xB7, 0xB0, 0xB9, 0xBE, 0xAB, 0xAC, 0xA5, 0xA2, 0x8F, 0x88, 0x81, 0x86, 0x93, 0x94, 0x9D, 0x9A,
+    0x27, 0x20, 0x29, 0x2E, 0x3B, 0x3C, 0x35, 0x32, 0x1F, 0x18, 0x11, 0x16, 0x03, 0x04, 0x0D, 0x0A,
+    0x57, 0x50, 0x59, 0x5E, 0x4B, 0x4C, 0x45, 0x42, 0x6F, 0x68, 0x61, 0x66, 0x73, 0x74, 0x7D, 0x7A,
+    0x89, 0x8E, 0x87, 0x80, 0x95, 0x92, 0x9B, 0x9C, 0xB1, 0xB6, 0xBF, 0xB8, 0xAD, 0xAA, 0xA3, 0xA4,
+    0xF9, 0xFE, 0xF7, 0xF0, 0xE5, 0xE2, 0xEB, 0xEC, 0xC1, 0xC6, 0xCF, 0xC8, 0xDD, 0xDA, 0xD3, 0xD4,
+    0x69, 0x6E, 0x67, 0x60, 0x75, 0x72, 0x7B, 0x7C, 0x51, 0x56, 0x5F, 0x58, 0x4D, 0x4A, 0x43, 0x44,
+    0x19, 0x1E, 0x17, 0x10, 0x05, 0x02, 0x0B, 0x0C, 0x21, 0x26, 0x2F, 0x28, 0x3D, 0x3A, 0x33, 0x34,
+    0x4E, 0x49, 0x40, 0x47, 0x52, 0x55, 0x5C, 0x5B, 0x76, 0x71, 0x78, 0x7F, 0x6A, 0x6D, 0x64, 0x63,
+    0x3E, 0x39, 0x30, 0x37, 0x22, 0x25, 0x2C, 0x2B, 0x06, 0x01, 0x08, 0x0F, 0x1A, 0x1D, 0x14, 0x13,
+    0xAE, 0xA9, 0xA0, 0xA7, 0xB2, 0xB5, 0xBC, 0xBB, 0x96, 0x91, 0x98, 0x9F, 0x8A, 0x8D, 0x84, 0x83,
+    0xDE, 0xD9, 0xD0, 0xD7, 0xC2, 0xC5, 0xCC, 0xCB, 0xE6, 0xE1, 0xE8, 0xEF, 0xFA, 0xFD, 0xF4, 0xF3
+};
+
+inline uint8_t _crc8_ccitt_update (uint8_t inCrc, uint8_t inData)
 {
-    static char b[9];
-    b[0] = '\0';
+    return crc8Table[inCrc ^ inData];
+}
 
-    int z;
-    for (z = 128; z > 0; z >>= 1)
-    {
-        strcat(b, ((x & z) == z) ? "1" : "0");
-    }
+#elif BQ769X0_CRC_IMPL == BQ769X0_CRC_NIBBLE
+
+// CRC of the upper nibble, to be processed 4 bits at a time
+static const uint8_t crc8NibbleTable[16] = {
+    0x00, 0x07, 0x0E, 0x09, 0x1C, 0x1B, 0x12, 0x15, 0x38, 0x3F, 0x36, 0x31, 0x24, 0x23, 0x2A, 0x2D
+};
+
+inline uint8_t _crc8_ccitt_update (uint8_t inCrc, uint8_t inData)
+{
+    uint8_t data = inCrc ^ inData;
+
+    data = (data << 4) ^ crc8NibbleTable[data >> 4];
+    data = (data << 4) ^ crc8NibbleTable[data >> 4];
+    return data;
+}
+
+#elif BQ769X0_CRC_IMPL == BQ769X0_CRC_STM32
+
+// hardware CRC unit with programmable polynomial (e.g. STM32F0/F3/F7/L0/L4)
+#if !defined(CRC_CR_POLYSIZE)
+#error "BQ769X0_CRC_STM32 requires a CRC unit with programmable polynomial size"
+#endif
+
+static void crc8HardwareInit(void)
+{
+    __HAL_RCC_CRC_CLK_ENABLE();
+    CRC->POL = 0x07;
+    CRC->CR = CRC_CR_POLYSIZE_1;    // 8-bit polynomial
+}
 
-    return b;
+inline uint8_t _crc8_ccitt_update (uint8_t inCrc, uint8_t inData)
+{
+    CRC->INIT = inCrc;
+    CRC->CR = CRC_CR_POLYSIZE_1 | CRC_CR_RESET;
+    *(__IO uint8_t *)&CRC->DR = inData;
+    return (uint8_t)CRC->DR;
 }
 
+#else // BQ769X0_CRC_BITWISE
+
 uint8_t _crc8_ccitt_update (uint8_t inCrc, uint8_t inData)
 {
     uint8_t   i;
@@ -56,12 +133,17 @@ uint8_t _crc8_ccitt_update (uint8_t inCrc, uint8_t inData)
     return data;
 }
 
+#endif
+
 //----------------------------------------------------------------------------
 
 bq769x0::bq769x0(I2C& bqI2C, PinName alertPin, int bqType, int bqI2CAddress, bool crc):
     _i2c(bqI2C), _alertInterrupt(alertPin)
 {
     _timer.start();
+#if BQ769X0_CRC_IMPL == BQ769X0_CRC_STM32
+    crc8HardwareInit();
+#endif
     _alertInterrupt.rise(callback(this, &bq769x0::setAlertInterruptFlag));
 
     // set some safe default values
@@ -70,9 +152,113 @@ bq769x0::bq769x0(I2C& bqI2C, PinName alertPin, int bqType, int bqI2CAddress, boo
     idleCurrentThreshold = 30; // mA
 
     thermistorBetaValue = 3435;  // typical value for Semitec 103AT-5 thermistor
+    calculateThermistorTable();
 
     alertInterruptFlag = true;   // init with true to check and clear errors at start-up
+    handlingFaults = false;
+    faultRetryPending = false;
+    softwareErrors = 0;
+    fetRecoveryPending = 0;
+    occThreshold_mA = 0;
+    maxChargeCurrent = 0;
+    maxDischargeCurrent = 0;
+    chargeCurrentLimit = 0;
+    dischargeCurrentLimit = 0;
+    minCellTempDischarge = 0;
+    maxCellTempDischarge = 0;
+    minCellTempCharge = 0;
+    maxCellTempCharge = 0;
+    cellTempHysteresis = 0;
+    minTemperature = 0;
+    maxTemperature = 0;
+    cellTempChargeError = false;
+    cellTempDischargeError = false;
+    cellTempChargeErrorFlag = false;
+    cellTempDischargeErrorFlag = false;
+    maxCellVoltage = 0;
+    minCellVoltage = 0;
+    occDelayPeriods = 1;
+    occPeriods = 0;
+    nextFaultRetry = 0;
+    for (int i = 0; i < NUM_FAULTS; i++) {
+        faultStates[i] = FAULT_NONE;
+        faultRetryTime[i] = 0;
+    }
+    errorStatus = 0;
+    balancingStatus = 0;
+    balancingReferenceVoltage = 0;
+    balancingLowPriority = 0;
+    balancingPhaseStart = 0;
+    balancingSuspended = 0;
+    balancingMeasurementInterval_ms = 0;
+    balancingSettleTime_ms = 100;
+    balancingMeasurementTimestamp = 0;
+    balancingWindowStart = 0;
+    balancingTimestamp = 0;
+    balancingOnTime_ms = 0;
+    balancingSuspendedTime_ms = 0;
+    idleTimestamp = 0;
+    powerState = POWER_NORMAL;
+    lowPowerEnabled = false;
+    lowPowerInterval_ms = 10000;
+    lowPowerIdleTime_ms = 60000;
+    powerStateTimestamp = 0;
+    resistanceState = RESISTANCE_IDLE;
+    resistanceStepThreshold = 0;
+    resistanceForgetting = 0.95f;
+    resistanceRefCurrent = 0;
+    resistanceRefValid = false;
+    resistanceSamples = 0;
+    telemetryLog = NULL;
+    socEstimator = NULL;
+    cellStats = NULL;
+    memset(OCV, 0, sizeof(OCV));
+    coulombCounter = 0;
+    ccAccumulator = 0;
+    ccOffset = 0;
+    ccRaw = 0;
+    ccTimestamp = 0;
+    ccTimestampValid = false;
+    missedCCReadings = 0;
+    resetStats();
+
+    maxRetries = 3;
+    retryTimeout_us = 5000;
+    probing = false;
+    sdaPin = NC;
+    sclPin = NC;
+    regCacheValid = 0;
+    cellVoltagesValid = 0;
+    temperaturesValid = 0;
+    temperaturesReceived = 0;   // temperatures invalid until first conversion
+
+    // readings are considered as very old until received (see readingAge)
+    unsigned long never = _timer.read_ms() - READING_AGE_UNKNOWN;
+    for (int i = 0; i < MAX_NUMBER_OF_CELLS; i++) {
+        cellVoltageTimestamp[i] = never;
+    }
+    for (int i = 0; i < MAX_NUMBER_OF_THERMISTORS; i++) {
+        temperatures[i] = 0;
+        temperatureTimestamp[i] = never;
+    }
+    batVoltageTimestamp = never;
+    nominalCapacity = 0;
+    currentScale = 0;
+    cellVoltageScale = 0;
+    batVoltageScale = 0;
+
+    memset(regCache, 0, sizeof(regCache));
+#if DEVICE_I2C_ASYNCH
+    asyncState = ASYNC_IDLE;
+#endif
+    regShadowValid = 0;
 
+    memset(snapshots, 0, sizeof(snapshots));
+    snapshotSequence = 0;
+
+#if BQ769X0_VARIANT
+    MBED_ASSERT(bqType == BQ769X0_VARIANT);
+#else
     type = bqType;
     if (type == bq76920) {
         numberOfCells = 5;
@@ -81,978 +267,2642 @@ bq769x0::bq769x0(I2C& bqI2C, PinName alertPin, int bqType, int bqI2CAddress, boo
     } else {
         numberOfCells = 15;
     }
+#endif
 
     // initialize variables
-    for (int i = 0; i < numberOfCells - 1; i++) {
+    for (int i = 0; i < MAX_NUMBER_OF_CELLS; i++) {
         cellVoltages[i] = 0;
+        balancingVoltages[i] = 0;
+        resistanceRefVoltages[i] = 0;
+        cellResistance[i] = 0;
+        cellResistanceCovariance[i] = RESISTANCE_INITIAL_COVARIANCE;
     }
+    idCellMaxVoltage = 0;
+    idCellMinVoltage = 0;
+    avgCellVoltage = 0;
+    connectedCells = 0;
+    setCellPopulationMask(0);   // all cells
+    calculateDeratingCurves();
 
-    //crcEnabled = crc;
-    //I2CAddress = bqI2CAddress;
-
-    if (determineAddressAndCrc())
+    if (determineAddressAndCrc(bqI2CAddress, crc))
     {
-        // initial settings for bq769x0
-        writeRegister(SYS_CTRL1, 0b00011000);  // switch external thermistor and ADC on
-        writeRegister(SYS_CTRL2, 0b01000000);  // switch CC_EN on
-
-        // get ADC offset and gain
-        adcOffset = (signed int) readRegister(ADCOFFSET);  // convert from 2's complement
-        adcGain = 365 + (((readRegister(ADCGAIN1) & 0b00001100) << 1) |
-            ((readRegister(ADCGAIN2) & 0b11100000) >> 5)); // uV/LSB
+        initialize();
     }
     else {
         // TODO: do something else... e.g. set error flag
-#if BQ769X0_DEBUG
-        printf("BMS communication error\n");
-#endif
+        BQ769X0_TRACE(BQ769X0_TRACE_ERROR, TRACE_COMM_ERROR, I2CAddress);
     }
 }
 
 //----------------------------------------------------------------------------
-// automatically find out address and CRC setting
+// initial settings for bq769x0 after power-up
 
-bool bq769x0::determineAddressAndCrc(void)
+void bq769x0::initialize()
 {
-    I2CAddress = 0x08;
-    crcEnabled = true;
-    writeRegister(CC_CFG, 0x19);
-    if (readRegister(CC_CFG) == 0x19) {
-        return true;
-    }
+    writeRegister(SYS_CTRL1, 0b00011000);  // switch external thermistor and ADC on
+    writeRegister(SYS_CTRL2, 0b01000000);  // switch CC_EN on
+
+    // get ADC offset and gain
+    uint8_t adcCal[2] = { 0, 0 };   // ADCGAIN1 and ADCOFFSET
+    readRegisters(ADCGAIN1, adcCal, 2);
+    adcOffset = (int8_t) adcCal[1];  // convert from 2's complement
+    adcGain = 365 + (((adcCal[0] & 0b00001100) << 1) |
+        ((readRegister(ADCGAIN2) & 0b11100000) >> 5)); // uV/LSB
+
+    cellVoltageScale = ((adcGain << 16) + 500) / 1000;
+    batVoltageScale = ((4 * adcGain << 14) + 500) / 1000;
+}
 
-    I2CAddress = 0x18;
-    crcEnabled = true;
-    writeRegister(CC_CFG, 0x19);
-    if (readRegister(CC_CFG) == 0x19) {
-        return true;
-    }
+//----------------------------------------------------------------------------
+// verifies the given address and CRC setting and only probes the other
+// combinations if the IC did not respond
 
-    I2CAddress = 0x08;
-    crcEnabled = false;
-    writeRegister(CC_CFG, 0x19);
-    if (readRegister(CC_CFG) == 0x19) {
+bool bq769x0::determineAddressAndCrc(int address, bool crc)
+{
+    static const struct {
+        uint8_t address;
+        bool crc;
+    } settings[] = { { 0x08, true }, { 0x18, true }, { 0x08, false }, { 0x18, false } };
+
+    if (verifyAddressAndCrc(address, crc)) {
         return true;
     }
 
-    I2CAddress = 0x18;
-    crcEnabled = false;
-    writeRegister(CC_CFG, 0x19);
-    if (readRegister(CC_CFG) == 0x19) {
-        return true;
+    for (unsigned int i = 0; i < sizeof(settings)/sizeof(settings[0]); i++) {
+        if ((settings[i].address != address || settings[i].crc != crc) &&
+            verifyAddressAndCrc(settings[i].address, settings[i].crc))
+        {
+            return true;
+        }
     }
 
-    return false;
+    // last attempt with the usual retries in case of a disturbed bus
+    setAddressAndCrc(address, crc);
+    return writeRegister(CC_CFG, 0x19) && readRegister(CC_CFG) == 0x19;
+}
+
+//----------------------------------------------------------------------------
+// single write and readback of CC_CFG (which has to be set to 0x19 anyway)
+
+bool bq769x0::verifyAddressAndCrc(int address, bool crc)
+{
+    setAddressAndCrc(address, crc);
+
+    probing = true;
+    bool verified = writeRegister(CC_CFG, 0x19) && readRegister(CC_CFG) == 0x19;
+    probing = false;
+
+    return verified;
+}
+
+//----------------------------------------------------------------------------
+
+int bq769x0::getI2CAddress()
+{
+    return I2CAddress;
+}
+
+//----------------------------------------------------------------------------
+
+bool bq769x0::isCrcEnabled()
+{
+    return crcEnabled;
+}
+
+//----------------------------------------------------------------------------
+// sets I2C address and CRC mode and pre-calculates the CRC of the address byte
+
+void bq769x0::setAddressAndCrc(int address, bool crc)
+{
+    I2CAddress = address;
+    crcEnabled = crc;
+    crcAddressWrite = _crc8_ccitt_update(0, (I2CAddress << 1) | 0);
+    crcAddressRead = _crc8_ccitt_update(0, (I2CAddress << 1) | 1);
 }
 
 //----------------------------------------------------------------------------
-// Boot IC by pulling the boot pin TS1 high for some ms
+// Boot IC by pulling the boot pin TS1 high and wait until it responds with
+// the known address and CRC setting. The other settings of the driver are
+// restored with the next update from the shadow registers (FETs stay off).
 
-void bq769x0::boot(PinName bootPin)
+bool bq769x0::boot(PinName bootPin)
 {
     DigitalInOut boot(bootPin);
+    bool booted = false;
 
+    boot.output();
     boot = 1;
-    wait_ms(5);   // wait 5 ms for device to receive boot signal (datasheet: max. 2 ms)
+    wait_ms(BOOT_SIGNAL_MS);
     boot.input();         // don't disturb temperature measurement
-    wait_ms(10);  // wait for device to boot up completely (datasheet: max. 10 ms)
+
+    for (int i = 0; i < BOOT_TIMEOUT_MS && !booted; i++) {
+        wait_ms(1);
+        booted = verifyAddressAndCrc(I2CAddress, crcEnabled);
+    }
+
+    if (booted) {
+        initialize();
+    }
+    return booted;
 }
 
 
 //----------------------------------------------------------------------------
 // Fast function to check whether BMS has an error
 // (returns 0 if everything is OK)
+//
+// SYS_STAT is only read after an alert of the IC or if a fault recovery
+// attempt is due, otherwise the last status is returned without bus access.
 
 int bq769x0::checkStatus()
 {
-    //  printf("errorStatus: ");
-    //  printf(errorStatus);
-    if (alertInterruptFlag == false && errorStatus == 0) {
-        return 0;
-    } else {
+    if (alertInterruptFlag == false && (faultRetryPending == false ||
+        (long)(_timer.read_ms() - nextFaultRetry) < 0))
+    {
+        return errorStatus;
+    }
+
+    int start_us = _timer.read_us();
+    regSYS_STAT_t sys_stat;
+
+    alertInterruptFlag = false;     // reset before reading, so that no new alert is lost
+    if (readRegisters(SYS_STAT, &regCache[SYS_STAT], 1) == false) {
+        alertInterruptFlag = true;  // try again with next call
+        recordTiming(stats.checkStatus, checkStatusTimeSum_us, start_us);
+        return errorStatus;         // keep previous status if communication failed
+    }
+    regCacheValid |= 1 << SYS_STAT;
+    sys_stat.regByte = regCache[SYS_STAT];
 
-        regSYS_STAT_t sys_stat;
-        sys_stat.regByte = readRegister(SYS_STAT);
+    // keep shadow of SYS_CTRL2 in sync with FETs switched off by the IC
+    if (sys_stat.regByte & (STAT_DEVICE_XREADY | STAT_OVRD_ALERT)) {
+        regShadow[SYS_CTRL2] &= ~0b00000011;
+    }
+    if (sys_stat.regByte & STAT_OV) {
+        regShadow[SYS_CTRL2] &= ~0b00000001;
+    }
+    if (sys_stat.regByte & (STAT_UV | STAT_SCD | STAT_OCD)) {
+        regShadow[SYS_CTRL2] &= ~0b00000010;
+    }
 
-        // first check, if only a new CC reading is available
-        if (sys_stat.bits.CC_READY == 1) {
-            //printf("Interrupt: CC ready");
-            updateCurrent();  // automatically clears CC ready flag
+    // first check, if only a new CC reading is available
+    if (sys_stat.bits.CC_READY == 1 &&
+        readRegisters(CC_HI_BYTE, &regCache[CC_HI_BYTE], 2))
+    {
+        regCacheValid |= (uint64_t)0b11 << CC_HI_BYTE;
+        updateCurrent();  // automatically clears CC ready flag
+        if (resistanceState == RESISTANCE_MEASURE) {
+            readCellVoltages();     // directly after the current step settled
         }
+        publishSnapshot();
+    }
 
-        // Serious error occured
-        if (sys_stat.regByte & 0b00111111)
-        {
-            if (alertInterruptFlag == true) {
-                secSinceErrorCounter = 0;
-            }
-            errorStatus = sys_stat.regByte;
+    // Serious error occured (detected by IC or software protection)
+    if ((sys_stat.regByte & STAT_FLAGS) || softwareErrors)
+    {
+        int status = sys_stat.regByte | softwareErrors;
+        if (errorStatus != status) {
+            BQ769X0_TRACE(BQ769X0_TRACE_WARNING, TRACE_FAULT, status);
+        }
+        errorStatus = status;
 
-            unsigned int secSinceInterrupt = (_timer.read_ms() - interruptTimestamp) / 1000;
+        exitLowPower();
 
-            // check for overrun of _timer.read_ms() or very slow running program
-            if (abs((long)(secSinceInterrupt - secSinceErrorCounter)) > 2) {
-                secSinceErrorCounter = secSinceInterrupt;
-            }
+        // FETs are enabled again from handleFaults(), which calls checkStatus()
+        if (handlingFaults == false) {
+            handlingFaults = true;
+            handleFaults(status);
+            handlingFaults = false;
+        }
+    }
+    else {
+        errorStatus = 0;
+        if (faultRetryPending) {
+            handleFaults(0);    // reset all fault states
+        }
+        if (handlingFaults == false) {
+            handlingFaults = true;
+            recoverFets();
+            handlingFaults = false;
+        }
+    }
 
-            // called only once per second
-            if (secSinceInterrupt >= secSinceErrorCounter)
-            {
-                if (sys_stat.regByte & 0b00100000) { // XR error
-                    // datasheet recommendation: try to clear after waiting a few seconds
-                    if (secSinceErrorCounter % 3 == 0) {
-                        #if BQ769X0_DEBUG
-                        printf("Attempting to clear XR error");
-                        #endif
-                        writeRegister(SYS_STAT, 0b00100000);
-                        enableCharging();
-                        enableDischarging();
-                    }
-                }
-                if (sys_stat.regByte & 0b00010000) { // Alert error
-                    if (secSinceErrorCounter % 10 == 0) {
-                        #if BQ769X0_DEBUG
-                        printf("Attempting to clear Alert error");
-                        #endif
-                        writeRegister(SYS_STAT, 0b00010000);
-                        enableCharging();
-                        enableDischarging();
-                    }
-                }
-                if (sys_stat.regByte & 0b00001000) { // UV error
-                    updateVoltages();
-                    if (cellVoltages[idCellMinVoltage] > minCellVoltage) {
-                        #if BQ769X0_DEBUG
-                        printf("Attempting to clear UV error");
-                        #endif
-                        writeRegister(SYS_STAT, 0b00001000);
-                        enableDischarging();
-                    }
-                }
-                if (sys_stat.regByte & 0b00000100) { // OV error
+    recordTiming(stats.checkStatus, checkStatusTimeSum_us, start_us);
+    return errorStatus;
+}
+
+//----------------------------------------------------------------------------
+// per-fault state machine: each fault is cleared at its scheduled retry time
+// if the cell voltages allow it, and the FETs are switched on again afterwards
+// (interval according to datasheet recommendation for XR, 1 s for checking
+// UV/OV voltages and 60 s for the current faults)
+
+static const unsigned long faultRetryInterval_ms[NUM_FAULTS] = {
+    60000,  // OCD
+    60000,  // SCD
+    1000,   // OV
+    1000,   // UV
+    10000,  // OVRD_ALERT
+    3000,   // DEVICE_XREADY
+    0,      // reserved
+    0,      // CC_READY (no fault)
+    60000   // software OCC
+};
+
+void bq769x0::handleFaults(int sysStat)
+{
+    unsigned long now = _timer.read_ms();
+    int clearFlags = 0;
+    bool voltagesUpdated = false;
+
+    for (int i = 0; i < NUM_FAULTS; i++)
+    {
+        int flag = 1 << i;
+
+        if ((sysStat & flag) == 0 || faultRetryInterval_ms[i] == 0) {
+            faultStates[i] = FAULT_NONE;
+            continue;
+        }
+
+        if (faultStates[i] != FAULT_WAITING) {
+            // new fault or previous attempt to clear it was not successful
+            stats.faultCounts[(flag == BQ769X0_ERR_OCC) ? FAULT_COUNT_OCC : i]++;
+            faultStates[i] = FAULT_WAITING;
+            faultRetryTime[i] = now + faultRetryInterval_ms[i];
+            continue;
+        }
+
+        if ((long)(now - faultRetryTime[i]) < 0) {
+            continue;
+        }
+
+        if (flag & (STAT_UV | STAT_OV)) {
+            // one voltage update for both UV and OV
+            if (voltagesUpdated == false) {
+                if (updateRegisterCache()) {
                     updateVoltages();
-                    if (cellVoltages[idCellMaxVoltage] < maxCellVoltage) {
-                        #if BQ769X0_DEBUG
-                        printf("Attempting to clear OV error");
-                        #endif
-                        writeRegister(SYS_STAT, 0b00000100);
-                        enableCharging();
-                    }
-                }
-                if (sys_stat.regByte & 0b00000010) { // SCD
-                    if (secSinceErrorCounter % 60 == 0) {
-                        #if BQ769X0_DEBUG
-                        printf("Attempting to clear SCD error");
-                        #endif
-                        writeRegister(SYS_STAT, 0b00000010);
-                        enableDischarging();
-                    }
                 }
-                if (sys_stat.regByte & 0b00000001) { // OCD
-                    if (secSinceErrorCounter % 60 == 0) {
-                        #if BQ769X0_DEBUG
-                        printf("Attempting to clear OCD error");
-                        #endif
-                        writeRegister(SYS_STAT, 0b00000001);
-                        enableDischarging();
+                voltagesUpdated = true;
+            }
+            if ((flag == STAT_UV && cellVoltages[idCellMinVoltage] <= minCellVoltage) ||
+                (flag == STAT_OV && cellVoltages[idCellMaxVoltage] >= maxCellVoltage))
+            {
+                faultRetryTime[i] = now + faultRetryInterval_ms[i];
+                continue;
+            }
+        }
+
+        // confirmed by reading SYS_STAT again, even if no new alert occurs
+        faultStates[i] = FAULT_CLEARING;
+        faultRetryTime[i] = now + FAULT_CONFIRMATION_MS;
+        clearFlags |= flag;
+    }
+
+    if (clearFlags != 0) {
+        BQ769X0_TRACE(BQ769X0_TRACE_INFO, TRACE_FAULT_CLEAR, clearFlags);
+        if (clearFlags & BQ769X0_ERR_OCC) {
+            softwareErrors &= ~BQ769X0_ERR_OCC;
+            errorStatus &= ~BQ769X0_ERR_OCC;
+            occPeriods = 0;
+        }
+        if (clearFlags & STAT_FLAGS) {
+            if (writeRegister(SYS_STAT, clearFlags & STAT_FLAGS)) {
+                errorStatus &= ~clearFlags;
+                regCache[SYS_STAT] &= ~clearFlags;
+            }
+            else {
+                // retry the flag reset soon instead of after the full interval
+                for (int i = 0; i < NUM_FAULTS; i++) {
+                    if (clearFlags & STAT_FLAGS & (1 << i)) {
+                        faultStates[i] = FAULT_WAITING;
                     }
                 }
-                secSinceErrorCounter++;
             }
         }
-        else {
-            errorStatus = 0;
+        if (clearFlags & (STAT_DEVICE_XREADY | STAT_OVRD_ALERT | STAT_OV | BQ769X0_ERR_OCC)) {
+            fetRecoveryPending |= 0b01;     // CHG
+        }
+        if (clearFlags & (STAT_DEVICE_XREADY | STAT_OVRD_ALERT | STAT_UV | STAT_SCD | STAT_OCD)) {
+            fetRecoveryPending |= 0b10;     // DSG
         }
+        recoverFets();
+    }
 
-        return errorStatus;
+    scheduleFaultRetry();
+}
+
+//----------------------------------------------------------------------------
+// switches the FETs on again which were switched off by cleared faults, as
+// soon as no other fault is active anymore (enabling is rejected before)
+
+void bq769x0::recoverFets()
+{
+    if (fetRecoveryPending == 0 || errorStatus != 0) {
+        return;
+    }
+    int fets = fetRecoveryPending;
+    fetRecoveryPending = 0;     // only one attempt without faults
+    if (fets & 0b01) {
+        enableCharging();
+    }
+    if (fets & 0b10) {
+        enableDischarging();
     }
 }
 
 //----------------------------------------------------------------------------
-// checks if temperatures are within the limits, otherwise disables CHG/DSG FET
+// sets the timeout for the next recovery attempt, which calls the alert handler
+// so that e.g. bq769x0Service runs checkStatus() exactly at that time
 
-void bq769x0::checkCellTemp()
+void bq769x0::scheduleFaultRetry()
 {
-    int numberOfThermistors = numberOfCells/5;
-    bool cellTempChargeError = 0;
-    bool cellTempDischargeError = 0;
+    faultRetryPending = false;
+    for (int i = 0; i < NUM_FAULTS; i++) {
+        if (faultStates[i] != FAULT_NONE &&
+            (faultRetryPending == false || (long)(faultRetryTime[i] - nextFaultRetry) < 0))
+        {
+            nextFaultRetry = faultRetryTime[i];
+            faultRetryPending = true;
+        }
+    }
+
+    _faultTimeout.detach();
+    if (faultRetryPending) {
+        long delay_ms = nextFaultRetry - _timer.read_ms();
+        if (delay_ms < 0) {
+            delay_ms = 0;
+        }
+        _faultTimeout.attach_us(callback(this, &bq769x0::faultRetryDue),
+            (us_timestamp_t)delay_ms * 1000);
+    }
+}
 
-    for (int thermistor = 0; thermistor < numberOfThermistors; thermistor++) {
-        cellTempChargeError |=
-            temperatures[thermistor] > maxCellTempCharge - cellTempChargeErrorFlag ? cellTempHysteresis : 0 ||
-            temperatures[thermistor] < minCellTempCharge + cellTempChargeErrorFlag ? cellTempHysteresis : 0;
+//----------------------------------------------------------------------------
+// called from interrupt context when a fault recovery attempt is due
 
-        cellTempDischargeError |=
-            temperatures[thermistor] > maxCellTempDischarge - cellTempDischargeErrorFlag ? cellTempHysteresis : 0 ||
-            temperatures[thermistor] < minCellTempDischarge + cellTempDischargeErrorFlag ? cellTempHysteresis : 0;
+void bq769x0::faultRetryDue()
+{
+    if (alertHandler) {
+        alertHandler();
     }
+}
+
+//----------------------------------------------------------------------------
+// verdict of the temperature protection, an error is only cleared after the
+// temperatures are back inside the limits by the hysteresis
+
+void bq769x0::checkTemperatureLimits()
+{
+    int chargeHysteresis = cellTempChargeError ? cellTempHysteresis : 0;
+    int dischargeHysteresis = cellTempDischargeError ? cellTempHysteresis : 0;
+
+    cellTempChargeError =
+        maxTemperature > maxCellTempCharge - chargeHysteresis ||
+        minTemperature < minCellTempCharge + chargeHysteresis;
+
+    cellTempDischargeError =
+        maxTemperature > maxCellTempDischarge - dischargeHysteresis ||
+        minTemperature < minCellTempDischarge + dischargeHysteresis;
+}
 
+//----------------------------------------------------------------------------
+// switches CHG/DSG FET off if the temperature verdict changes to error and on
+// again after it was cleared
+
+void bq769x0::checkCellTemp()
+{
     if (cellTempChargeErrorFlag != cellTempChargeError) {
         cellTempChargeErrorFlag = cellTempChargeError;
         if (cellTempChargeError) {
+            stats.faultCounts[FAULT_COUNT_TEMP_CHG]++;
             disableCharging();
-            #if BQ769X0_DEBUG
-            printf("Temperature error (CHG)");
-            #endif
+            BQ769X0_TRACE(BQ769X0_TRACE_WARNING, TRACE_TEMP_ERROR_CHG, temperatures[0]);
         }
         else {
             enableCharging();
-            #if BQ769X0_DEBUG
-            printf("Clearing temperature error (CHG)");
-            #endif
+            BQ769X0_TRACE(BQ769X0_TRACE_INFO, TRACE_TEMP_CLEAR_CHG, temperatures[0]);
         }
     }
 
     if (cellTempDischargeErrorFlag != cellTempDischargeError) {
         cellTempDischargeErrorFlag = cellTempDischargeError;
         if (cellTempDischargeError) {
+            stats.faultCounts[FAULT_COUNT_TEMP_DSG]++;
             disableDischarging();
-            #if BQ769X0_DEBUG
-            printf("Temperature error (DSG)");
-            #endif
+            BQ769X0_TRACE(BQ769X0_TRACE_WARNING, TRACE_TEMP_ERROR_DSG, temperatures[0]);
         }
         else {
             enableDischarging();
-            #if BQ769X0_DEBUG
-            printf("Clearing temperature error (DSG)");
-            #endif
+            BQ769X0_TRACE(BQ769X0_TRACE_INFO, TRACE_TEMP_CLEAR_DSG, temperatures[0]);
         }
     }
 }
 
 //----------------------------------------------------------------------------
 // should be called at least once every 250 ms to get correct coulomb counting
+// (not necessary if bq769x0Service is used, which reads CC_READY immediately)
 
 void bq769x0::update()
 {
-    updateCurrent();  // will only read new current value if alert was triggered
-    updateVoltages();
-    updateTemperatures();
-    updateBalancingSwitches();
-    checkCellTemp();
-}
+    if (updatePowerState() == false) {
+        return;     // no new measurements in low-power mode
+    }
 
-//----------------------------------------------------------------------------
-// puts BMS IC into SHIP mode (i.e. switched off)
+    int start_us = _timer.read_us();
+    uint32_t startTransactions = stats.i2cTransactions;
 
-void bq769x0::shutdown()
-{
-    writeRegister(SYS_CTRL1, 0x0);
-    writeRegister(SYS_CTRL1, 0x1);
-    writeRegister(SYS_CTRL1, 0x2);
+    // all measurements are taken from one consistent set of register values,
+    // readings with registers not received correctly keep their last value
+    updateRegisterCache();
+    processRegisterCache();
+    finishUpdate();
+
+    if (powerState == POWER_LOW_SAMPLING) {
+        if (balancingStatus != 0) {
+            exitLowPower();
+        }
+        else {
+            // ADC off until next sample
+            writeRegister(SYS_CTRL1, readShadowRegister(SYS_CTRL1) & ~0b00010000);
+            powerState = POWER_LOW_IDLE;
+            powerStateTimestamp = _timer.read_ms();
+        }
+    }
+    else if (lowPowerEnabled && powerState == POWER_NORMAL && errorStatus == 0 &&
+        balancingStatus == 0 && _timer.read_ms() - idleTimestamp >= (unsigned long)lowPowerIdleTime_ms)
+    {
+        enterLowPower();
+    }
+
+    stats.transactionsLastUpdate = stats.i2cTransactions - startTransactions;
+    if (stats.transactionsLastUpdate > stats.transactionsMaxUpdate) {
+        stats.transactionsMaxUpdate = stats.transactionsLastUpdate;
+    }
+    recordTiming(stats.update, updateTimeSum_us, start_us);
 }
 
 //----------------------------------------------------------------------------
+// starts the samples in low-power mode and returns true if the registers
+// should be read in this update
 
-bool bq769x0::enableCharging()
+bool bq769x0::updatePowerState()
 {
-    #if BQ769X0_DEBUG
-    printf("checkStatus() = %d\n", checkStatus());
-    printf("Umax = %d\n", cellVoltages[idCellMaxVoltage]);
-    printf("temperatures[0] = %d\n", temperatures[0]);
-    #endif
-
-    int numberOfThermistors = numberOfCells/5;
-    bool cellTempChargeError = 0;
+    unsigned long now = _timer.read_ms();
 
-    for (int thermistor = 0; thermistor < numberOfThermistors; thermistor++) {
-        cellTempChargeError |=
-            temperatures[thermistor] > maxCellTempCharge ||
-            temperatures[thermistor] < minCellTempCharge;
+    if (powerState == POWER_LOW_IDLE && now - powerStateTimestamp >= (unsigned long)lowPowerInterval_ms) {
+        writeRegister(SYS_CTRL1, readShadowRegister(SYS_CTRL1) | 0b00010000);   // ADC_EN
+        writeRegister(SYS_CTRL2, readShadowRegister(SYS_CTRL2) | 0b00100000);   // CC_ONESHOT
+        powerState = POWER_LOW_SAMPLING;
+        powerStateTimestamp = now;
+        return false;
     }
-
-    if (checkStatus() == 0 &&
-        cellVoltages[idCellMaxVoltage] < maxCellVoltage &&
-        cellTempChargeError == 0)
+    else if (powerState == POWER_LOW_IDLE ||
+        (powerState == POWER_LOW_SAMPLING && now - powerStateTimestamp < CC_PERIOD_MS))
     {
-        int sys_ctrl2;
-        sys_ctrl2 = readRegister(SYS_CTRL2);
-        writeRegister(SYS_CTRL2, sys_ctrl2 | 0b00000001);  // switch CHG on
-        #if BQ769X0_DEBUG
-        printf("Enabling CHG FET\n");
-        #endif
-        return true;
-    }
-    else {
-        return false;
+        return false;   // waiting for next sample or end of conversion
     }
+    return true;
 }
 
 //----------------------------------------------------------------------------
 
-void bq769x0::disableCharging()
+void bq769x0::enterLowPower()
 {
-    int sys_ctrl2;
-    sys_ctrl2 = readRegister(SYS_CTRL2);
-    writeRegister(SYS_CTRL2, sys_ctrl2 & ~0b00000001);  // switch CHG off
-    #if BQ769X0_DEBUG
-    printf("Disabling CHG FET\n");
-    #endif
+    // CC readings are integrated over the elapsed time of the samples
+    writeRegister(SYS_CTRL2, readShadowRegister(SYS_CTRL2) & ~0b01000000);  // CC_EN off
+    writeRegister(SYS_CTRL1, readShadowRegister(SYS_CTRL1) & ~0b00010000);  // ADC_EN off
+    powerState = POWER_LOW_IDLE;
+    powerStateTimestamp = _timer.read_ms();
 }
 
 //----------------------------------------------------------------------------
 
-bool bq769x0::enableDischarging()
+void bq769x0::exitLowPower()
 {
-    #if BQ769X0_DEBUG
-    printf("checkStatus() = %d\n", checkStatus());
-    printf("Umin = %d\n", cellVoltages[idCellMinVoltage]);
-    printf("temperatures[0] = %d\n", temperatures[0]);
-    #endif
-
-    int numberOfThermistors = numberOfCells/5;
-    bool cellTempDischargeError = 0;
-
-    for (int thermistor = 0; thermistor < numberOfThermistors; thermistor++) {
-        cellTempDischargeError |=
-            temperatures[thermistor] > maxCellTempDischarge ||
-            temperatures[thermistor] < minCellTempDischarge;
-    }
-
-    if (checkStatus() == 0 &&
-        cellVoltages[idCellMinVoltage] > minCellVoltage &&
-        cellTempDischargeError == 0)
-    {
-        int sys_ctrl2;
-        sys_ctrl2 = readRegister(SYS_CTRL2);
-        writeRegister(SYS_CTRL2, sys_ctrl2 | 0b00000010);  // switch DSG on
-        return true;
-    }
-    else {
-        return false;
+    if (powerState == POWER_NORMAL) {
+        return;
     }
+    powerState = POWER_NORMAL;
+    writeRegister(SYS_CTRL1, readShadowRegister(SYS_CTRL1) | 0b00010000);
+    writeRegister(SYS_CTRL2, (readShadowRegister(SYS_CTRL2) & ~0b00100000) | 0b01000000);
+    idleTimestamp = _timer.read_ms();
 }
 
 //----------------------------------------------------------------------------
 
-void bq769x0::disableDischarging()
+void bq769x0::enableLowPowerMode(int interval_s, int idleTime_s)
 {
-    int sys_ctrl2;
-    sys_ctrl2 = readRegister(SYS_CTRL2);
-    writeRegister(SYS_CTRL2, sys_ctrl2 & ~0b00000010);  // switch DSG off
-    #if BQ769X0_DEBUG
-    printf("Disabling DISCHG FET\n");
-    #endif
+    lowPowerInterval_ms = interval_s * 1000;
+    lowPowerIdleTime_ms = idleTime_s * 1000;
+    lowPowerEnabled = true;
 }
 
 //----------------------------------------------------------------------------
 
-void bq769x0::enableAutoBalancing(void)
+void bq769x0::disableLowPowerMode()
 {
-    autoBalancingEnabled = true;
+    lowPowerEnabled = false;
+    exitLowPower();
 }
 
-
 //----------------------------------------------------------------------------
 
-void bq769x0::setBalancingThresholds(int idleTime_min, int absVoltage_mV, int voltageDifference_mV)
+bool bq769x0::isLowPowerActive()
 {
-    balancingMinIdleTime_s = idleTime_min * 60;
-    balancingMinCellVoltage_mV = absVoltage_mV;
-    balancingMaxVoltageDifference_mV = voltageDifference_mV;
+    return powerState != POWER_NORMAL;
 }
 
 //----------------------------------------------------------------------------
-// sets balancing registers if balancing is allowed
-// (sufficient idle time + voltage)
+// common part of all update methods after the measurements were evaluated
 
-void bq769x0::updateBalancingSwitches(void)
+void bq769x0::finishUpdate()
 {
-    long idleSeconds = (_timer.read_ms() - idleTimestamp) / 1000;
-    int numberOfSections = numberOfCells/5;
+    updateBalancingSwitches();
+    checkCellTemp();
+    updateCurrentLimits();
+    publishSnapshot();
 
-    // check for _timer.read_ms() overflow
-    if (idleSeconds < 0) {
-        idleTimestamp = 0;
-        idleSeconds = _timer.read_ms() / 1000;
+    if (socEstimator != NULL) {
+        socEstimator->update(snapshots[snapshotSequence & 1]);
     }
+    if (telemetryLog != NULL) {
+        telemetryLog->write(snapshots[snapshotSequence & 1]);
+    }
+}
 
-    // check if balancing allowed
-    if (checkStatus() == 0 &&
-        idleSeconds >= balancingMinIdleTime_s &&
-        cellVoltages[idCellMaxVoltage] > balancingMinCellVoltage_mV &&
-        (cellVoltages[idCellMaxVoltage] - cellVoltages[idCellMinVoltage]) > balancingMaxVoltageDifference_mV)
-    {
-        //printf("Balancing enabled!");
-        balancingStatus = 0;  // current status will be set in following loop
-
-        //regCELLBAL_t cellbal;
-        int balancingFlags;
-        int balancingFlagsTarget;
-
-        for (int section = 0; section < numberOfSections; section++)
-        {
-            // find cells which should be balanced and sort them by voltage descending
-            int cellList[5];
-            int cellCounter = 0;
-            for (int i = 0; i < 5; i++)
-            {
-                if ((cellVoltages[section*5 + i] - cellVoltages[idCellMinVoltage]) > balancingMaxVoltageDifference_mV) {
-                    int j = cellCounter;
-                    while (j > 0 && cellVoltages[section*5 + cellList[j - 1]] < cellVoltages[section*5 + i])
-                    {
-                        cellList[j] = cellList[j - 1];
-                        j--;
-                    }
-                    cellList[j] = i;
-                    cellCounter++;
-                }
-            }
-
-            balancingFlags = 0;
-            for (int i = 0; i < cellCounter; i++)
-            {
-                // try to enable balancing of current cell
-                balancingFlagsTarget = balancingFlags | (1 << cellList[i]);
-
-                // check if attempting to balance adjacent cells
-                bool adjacentCellCollision =
-                    ((balancingFlagsTarget << 1) & balancingFlags) ||
-                    ((balancingFlags << 1) & balancingFlagsTarget);
-
-                if (adjacentCellCollision == false) {
-                    balancingFlags = balancingFlagsTarget;
-                }
-            }
-
-            #if BQ769X0_DEBUG
-            //printf("Setting CELLBAL%d register to: %s\n", section+1, byte2char(balancingFlags));
-            #endif
-
-            balancingStatus |= balancingFlags << section*5;
-
-            // set balancing register for this section
-            writeRegister(CELLBAL1+section, balancingFlags);
+//----------------------------------------------------------------------------
+// value of the piecewise-linear function through the n points (x ascending),
+// constant outside of the points
 
-        } // section loop
+static int interpolatePoints(const int *x, const int *f, int n, int value)
+{
+    if (value <= x[0]) {
+        return f[0];
     }
-    else if (balancingStatus > 0)
-    {
-        // clear all CELLBAL registers
-        for (int section = 0; section < numberOfSections; section++)
-        {
-            #if BQ769X0_DEBUG
-            printf("Clearing Register CELLBAL%d\n", section+1);
-            #endif
-
-            writeRegister(CELLBAL1+section, 0x0);
+    for (int i = 1; i < n; i++) {
+        if (value < x[i]) {
+            return f[i-1] + (long)(f[i] - f[i-1]) * (value - x[i-1]) / (x[i] - x[i-1]);
         }
-
-        balancingStatus = 0;
     }
+    return f[n-1];
 }
 
 //----------------------------------------------------------------------------
+// samples the function through the points on the grid of the curve (starting
+// at the first point). Both ends of grid segments with a point inside get the
+// minimum of the function within the segment, so that the linear
+// interpolation of the table never exceeds the function.
 
-int bq769x0::getBalancingStatus()
+static void buildDeratingCurve(DeratingCurve& curve, const int *x, const int *f, int n)
+{
+    curve.origin = x[0];
+    curve.shift = 0;
+    while (x[n-1] - x[0] > (DERATING_CURVE_POINTS - 1) << curve.shift) {
+        curve.shift++;
+    }
+
+    int step = 1 << curve.shift;
+    for (int i = 0; i < DERATING_CURVE_POINTS; i++) {
+        curve.factor[i] = interpolatePoints(x, f, n, curve.origin + i * step);
+    }
+
+    for (int j = 1; j < n; j++) {
+        int i = (x[j] - curve.origin) >> curve.shift;
+        if (i >= DERATING_CURVE_POINTS - 1 || x[j] == curve.origin + i * step) {
+            continue;   // on grid point
+        }
+        int factor = std::min(f[j], (int)std::min(curve.factor[i], curve.factor[i+1]));
+        curve.factor[i] = std::min((int)curve.factor[i], factor);
+        curve.factor[i+1] = std::min((int)curve.factor[i+1], factor);
+    }
+}
+
+//----------------------------------------------------------------------------
+
+static int deratingFactor(const DeratingCurve& curve, int value)
+{
+    int pos = value - curve.origin;
+    if (pos <= 0) {
+        return curve.factor[0];
+    }
+    int i = pos >> curve.shift;
+    if (i >= DERATING_CURVE_POINTS - 1) {
+        return curve.factor[DERATING_CURVE_POINTS - 1];
+    }
+    int fraction = pos & ((1 << curve.shift) - 1);
+    return curve.factor[i] + (((curve.factor[i+1] - curve.factor[i]) * fraction) >> curve.shift);
+}
+
+//----------------------------------------------------------------------------
+// derating tables according to the temperature and cell voltage limits,
+// recalculated whenever the limits are changed
+
+void bq769x0::calculateDeratingCurves()
+{
+    const int ramp[4] = { 0, DERATING_UNITY, DERATING_UNITY, 0 };
+    const int down[2] = { DERATING_UNITY, 0 };
+    const int up[2] = { 0, DERATING_UNITY };
+    const int none[2] = { DERATING_UNITY, DERATING_UNITY };
+
+    // ramp inside the limits, reduced if the limits are too close
+    int maxTemp = std::max(maxCellTempCharge, minCellTempCharge);
+    int band = std::min(DERATING_TEMP_BAND, (maxTemp - minCellTempCharge) / 2);
+    int charge[4] = { minCellTempCharge, minCellTempCharge + band, maxTemp - band, maxTemp };
+    buildDeratingCurve(chargeTempDerating, charge, ramp, 4);
+
+    maxTemp = std::max(maxCellTempDischarge, minCellTempDischarge);
+    band = std::min(DERATING_TEMP_BAND, (maxTemp - minCellTempDischarge) / 2);
+    int discharge[4] = { minCellTempDischarge, minCellTempDischarge + band, maxTemp - band, maxTemp };
+    buildDeratingCurve(dischargeTempDerating, discharge, ramp, 4);
+
+    // no voltage derating if limits are not set
+    int maxVoltage[2] = { maxCellVoltage - DERATING_VOLTAGE_BAND, maxCellVoltage };
+    buildDeratingCurve(chargeVoltageDerating, maxVoltage, maxCellVoltage > 0 ? down : none, 2);
+    int minVoltage[2] = { minCellVoltage, minCellVoltage + DERATING_VOLTAGE_BAND };
+    buildDeratingCurve(dischargeVoltageDerating, minVoltage, minCellVoltage > 0 ? up : none, 2);
+
+    const int full[2] = { DERATING_UNITY, DERATING_SOC_FACTOR };
+    const int empty[2] = { DERATING_SOC_FACTOR, DERATING_UNITY };
+    int socHigh[2] = { 1000 - DERATING_SOC_BAND, 1000 };
+    buildDeratingCurve(chargeSocDerating, socHigh, full, 2);
+    int socLow[2] = { 0, DERATING_SOC_BAND };
+    buildDeratingCurve(dischargeSocDerating, socLow, empty, 2);
+}
+
+//----------------------------------------------------------------------------
+// allowed charge and discharge currents based on the last measurements: the
+// lowest derating factor of all criteria applies, with estimated cell
+// resistance also the current which reaches the cell voltage limits
+
+void bq769x0::updateCurrentLimits()
+{
+    int chargeFactor = deratingFactor(chargeVoltageDerating, cellVoltages[idCellMaxVoltage]);
+    int dischargeFactor = deratingFactor(dischargeVoltageDerating, cellVoltages[idCellMinVoltage]);
+
+    // no temperature derating before the first valid thermistor reading
+    if (temperaturesReceived != 0) {
+        chargeFactor = std::min(chargeFactor, std::min(deratingFactor(chargeTempDerating, minTemperature),
+            deratingFactor(chargeTempDerating, maxTemperature)));
+        dischargeFactor = std::min(dischargeFactor, std::min(deratingFactor(dischargeTempDerating, minTemperature),
+            deratingFactor(dischargeTempDerating, maxTemperature)));
+    }
+
+    if (nominalCapacity > 0) {
+        int soc = (socEstimator != NULL && socEstimator->isInitialized()) ?
+            socEstimator->getSOC() * 10 : coulombCounter * 1000 / nominalCapacity;    // 0.1 %
+        chargeFactor = std::min(chargeFactor, deratingFactor(chargeSocDerating, soc));
+        dischargeFactor = std::min(dischargeFactor, deratingFactor(dischargeSocDerating, soc));
+    }
+
+    long charge = maxChargeCurrent * chargeFactor / DERATING_UNITY;
+    long discharge = maxDischargeCurrent * dischargeFactor / DERATING_UNITY;
+
+    // cell voltage at the limit current: OCV + I * R (incl. polarization)
+    if (resistanceSamples > 0) {
+        for (int j = 0; j < numberOfPopulatedCells; j++) {
+            int i = cellMap[j];
+            float resistance = cellResistance[i];   // mOhm
+            if (resistance <= 0 || cellVoltages[i] <= 500) {
+                continue;
+            }
+            float ocv = cellVoltages[i] - batCurrent * resistance / 1000;
+            if (maxCellVoltage > 0) {
+                charge = std::min(charge, (long)((maxCellVoltage - ocv) * 1000 / resistance));
+            }
+            if (minCellVoltage > 0) {
+                discharge = std::min(discharge, (long)((ocv - minCellVoltage) * 1000 / resistance));
+            }
+        }
+    }
+
+    chargeCurrentLimit = std::max(charge, 0L);
+    dischargeCurrentLimit = std::max(discharge, 0L);
+}
+
+//----------------------------------------------------------------------------
+// puts BMS IC into SHIP mode (i.e. switched off)
+
+void bq769x0::shutdown()
+{
+    writeRegister(SYS_CTRL1, 0x0);
+    writeRegister(SYS_CTRL1, 0x1);
+    writeRegister(SYS_CTRL1, 0x2);
+}
+
+//----------------------------------------------------------------------------
+
+bool bq769x0::enableCharging()
+{
+    int sysCtrl2 = readShadowRegister(SYS_CTRL2);
+
+    if (checkStatus() == 0 && sysCtrl2 >= 0 &&
+        cellVoltages[idCellMaxVoltage] < maxCellVoltage &&
+        cellTempChargeError == false)
+    {
+        updateRegister(SYS_CTRL2, sysCtrl2 | 0b00000001);  // switch CHG on
+        BQ769X0_TRACE(BQ769X0_TRACE_INFO, TRACE_CHG_ON, 0);
+        return true;
+    }
+    else {
+        BQ769X0_TRACE(BQ769X0_TRACE_DEBUG, TRACE_CHG_REJECTED, errorStatus);
+        return false;
+    }
+}
+
+//----------------------------------------------------------------------------
+
+void bq769x0::disableCharging()
+{
+    // always written to the IC, even if the shadow register claims it is off already
+    writeRegister(SYS_CTRL2, readShadowRegister(SYS_CTRL2) & ~0b00000001);  // switch CHG off
+    BQ769X0_TRACE(BQ769X0_TRACE_INFO, TRACE_CHG_OFF, 0);
+}
+
+//----------------------------------------------------------------------------
+
+bool bq769x0::enableDischarging()
+{
+    int sysCtrl2 = readShadowRegister(SYS_CTRL2);
+
+    if (checkStatus() == 0 && sysCtrl2 >= 0 &&
+        cellVoltages[idCellMinVoltage] > minCellVoltage &&
+        cellTempDischargeError == false)
+    {
+        updateRegister(SYS_CTRL2, sysCtrl2 | 0b00000010);  // switch DSG on
+        BQ769X0_TRACE(BQ769X0_TRACE_INFO, TRACE_DSG_ON, 0);
+        return true;
+    }
+    else {
+        BQ769X0_TRACE(BQ769X0_TRACE_DEBUG, TRACE_DSG_REJECTED, errorStatus);
+        return false;
+    }
+}
+
+//----------------------------------------------------------------------------
+
+void bq769x0::disableDischarging()
+{
+    // always written to the IC, even if the shadow register claims it is off already
+    writeRegister(SYS_CTRL2, readShadowRegister(SYS_CTRL2) & ~0b00000010);  // switch DSG off
+    BQ769X0_TRACE(BQ769X0_TRACE_INFO, TRACE_DSG_OFF, 0);
+}
+
+//----------------------------------------------------------------------------
+
+void bq769x0::enableAutoBalancing(void)
+{
+    autoBalancingEnabled = true;
+}
+
+
+//----------------------------------------------------------------------------
+
+void bq769x0::setBalancingThresholds(int idleTime_min, int absVoltage_mV, int voltageDifference_mV)
+{
+    balancingMinIdleTime_s = idleTime_min * 60;
+    balancingMinCellVoltage_mV = absVoltage_mV;
+    balancingMaxVoltageDifference_mV = voltageDifference_mV;
+}
+
+//----------------------------------------------------------------------------
+// all switch combinations of one 5-cell section without adjacent cells, which
+// must not be balanced at the same time (most cells first)
+
+static const uint8_t balancingMasks[] = {
+    0b10101,
+    0b00101, 0b01001, 0b10001, 0b01010, 0b10010, 0b10100,
+    0b00001, 0b00010, 0b00100, 0b01000, 0b10000,
+    0b00000
+};
+#define NUM_BALANCING_MASKS (sizeof(balancingMasks) / sizeof(balancingMasks[0]))
+
+//----------------------------------------------------------------------------
+// sets balancing registers if balancing is allowed
+// (sufficient idle time + voltage)
+//
+// The balanced cells are only re-evaluated if a cell voltage changed by more
+// than BALANCING_HYSTERESIS_MV or after BALANCING_PHASE_MS. With each new
+// phase the cells balanced before get low priority, so that cells blocked by
+// balanced neighbours get their turn.
+//
+// If measurement windows are enabled, the cell voltages measured while the
+// switches are on (and biased by the balancing current) are not evaluated.
+// Instead, balancing is suspended regularly for one measurement after the
+// settle time and resumed afterwards, spread over several calls.
+
+void bq769x0::updateBalancingSwitches(void)
+{
+    unsigned long now = _timer.read_ms();
+    long idleSeconds = (now - idleTimestamp) / 1000;
+
+    // reference can be set by bq769x0Stack to balance against all ICs of a pack
+    int minVoltage = (balancingReferenceVoltage > 0) ?
+        balancingReferenceVoltage : balancingCellVoltage(idCellMinVoltage);
+
+    // check for _timer.read_ms() overflow
+    if (idleSeconds < 0) {
+        idleTimestamp = 0;
+        idleSeconds = now / 1000;
+    }
+
+    // statistics for duty cycle
+    if (balancingStatus != 0) {
+        balancingOnTime_ms += now - balancingTimestamp;
+    }
+    else if (balancingSuspended != 0) {
+        balancingSuspendedTime_ms += now - balancingTimestamp;
+    }
+    balancingTimestamp = now;
+
+    if (balancingSuspended != 0) {
+        if (balancingWindowSettled(now) == false) {
+            return;     // voltages not yet settled
+        }
+        balancingMeasurementTimestamp = now;
+    }
+    else if (balancingStatus != 0 && balancingMeasurementInterval_ms > 0 &&
+        now - balancingMeasurementTimestamp >= (unsigned long)balancingMeasurementInterval_ms)
+    {
+        // start measurement window
+        balancingSuspended = balancingStatus;
+        balancingWindowStart = now;
+        writeBalancingSwitches(0);
+        return;
+    }
+
+    bool voltagesUnbiased = (balancingStatus == 0 || balancingMeasurementInterval_ms == 0);
+
+    // check if balancing allowed (voltages checked only if not biased)
+    if (checkStatus() == 0 &&
+        idleSeconds >= balancingMinIdleTime_s &&
+        (voltagesUnbiased == false || (
+            balancingCellVoltage(idCellMaxVoltage) > balancingMinCellVoltage_mV &&
+            (balancingCellVoltage(idCellMaxVoltage) - minVoltage) > balancingMaxVoltageDifference_mV)))
+    {
+        unsigned int active = balancingStatus | balancingSuspended;
+
+        if (active == 0) {
+            balancingLowPriority = 0;
+            balancingPhaseStart = now;
+        }
+        else if (voltagesUnbiased && now - balancingPhaseStart >= BALANCING_PHASE_MS) {
+            balancingLowPriority = active;
+            balancingPhaseStart = now;
+        }
+        else if (voltagesUnbiased == false || balancingVoltagesChanged() == false) {
+            // keep current switches (or resume after measurement window)
+            if (balancingSuspended != 0) {
+                writeBalancingSwitches(balancingSuspended);
+                balancingSuspended = 0;
+            }
+            return;
+        }
+
+        writeBalancingSwitches(calculateBalancingMask(minVoltage));
+        balancingSuspended = 0;
+        balancingMeasurementTimestamp = now;
+        for (int i = 0; i < numberOfCells; i++) {
+            balancingVoltages[i] = balancingCellVoltage(i);
+        }
+    }
+    else if (balancingStatus != 0 || balancingSuspended != 0)
+    {
+        writeBalancingSwitches(0);
+        balancingSuspended = 0;
+    }
+}
+
+//----------------------------------------------------------------------------
+// sets CELLBAL registers of all sections and balancingStatus
+
+void bq769x0::writeBalancingSwitches(unsigned int mask)
+{
+    int numberOfSections = numberOfCells/5;
+
+    for (int section = 0; section < numberOfSections; section++) {
+        updateRegister(CELLBAL1+section, (mask >> section*5) & 0b11111);
+    }
+
+    if (mask != balancingStatus) {
+        BQ769X0_TRACE(BQ769X0_TRACE_DEBUG, TRACE_BALANCING, mask);
+    }
+    balancingStatus = mask;
+}
+
+//----------------------------------------------------------------------------
+// regular suspension of balancing for unbiased voltage measurements
+// (interval 0 disables measurement windows)
+
+void bq769x0::setBalancingMeasurementWindow(int interval_s, int settleTime_ms)
+{
+    balancingMeasurementInterval_ms = interval_s * 1000;
+    balancingSettleTime_ms = settleTime_ms;
+}
+
+//----------------------------------------------------------------------------
+// ratio of time with switches on vs. time suspended for measurements
+
+float bq769x0::getBalancingDutyCycle()
+{
+    uint64_t total = balancingOnTime_ms + balancingSuspendedTime_ms;
+    if (total == 0) {
+        return 0;
+    }
+    return (float)balancingOnTime_ms / total;
+}
+
+//----------------------------------------------------------------------------
+// selects the cells to be balanced, maximizing the sum of voltage differences
+// to minVoltage (i.e. removed charge) of all balanced cells
+//
+// Each section gets one of the precalculated masks. The top cell of a section
+// and the bottom cell of the next section are adjacent as well, so the masks
+// of all sections are chosen together (dynamic programming over the sections
+// with the state whether the top cell of the previous section is balanced).
+
+unsigned int bq769x0::calculateBalancingMask(int minVoltage)
+{
+    int numberOfSections = numberOfCells/5;
+    int weights[MAX_NUMBER_OF_CELLS];
+    unsigned int candidates = 0;
+
+    for (int i = 0; i < numberOfCells; i++) {
+        int difference = balancingCellVoltage(i) - minVoltage;
+        weights[i] = 0;
+        if ((cellPopulationMask & (1 << i)) && difference > balancingMaxVoltageDifference_mV) {
+            candidates |= 1 << i;
+            // cells balanced in previous phase only used if they don't block others
+            weights[i] = (balancingLowPriority & (1 << i)) ? 1 : difference;
+        }
+    }
+
+    // score[t]: best sum of weights so far with top cell of last section on (t = 1) or off
+    long score[2] = { 0, -1 };
+    uint8_t choice[MAX_NUMBER_OF_CELLS / 5][2];     // mask index
+    uint8_t previousTop[MAX_NUMBER_OF_CELLS / 5][2];
+
+    for (int section = 0; section < numberOfSections; section++)
+    {
+        long newScore[2] = { -1, -1 };
+        int sectionCandidates = (candidates >> section*5) & 0b11111;
+
+        for (int prev = 0; prev < 2; prev++) {
+            if (score[prev] < 0) {
+                continue;
+            }
+            for (unsigned int m = 0; m < NUM_BALANCING_MASKS; m++) {
+                int mask = balancingMasks[m];
+                if ((mask & ~sectionCandidates) || (prev == 1 && (mask & 0b00001))) {
+                    continue;
+                }
+                long sum = score[prev];
+                for (int bit = 0; bit < 5; bit++) {
+                    if (mask & (1 << bit)) {
+                        sum += weights[section*5 + bit];
+                    }
+                }
+                int top = (mask >> 4) & 1;
+                if (sum > newScore[top]) {
+                    newScore[top] = sum;
+                    choice[section][top] = m;
+                    previousTop[section][top] = prev;
+                }
+            }
+        }
+        score[0] = newScore[0];
+        score[1] = newScore[1];
+    }
+
+    // trace back the chosen masks
+    unsigned int result = 0;
+    int top = (score[1] > score[0]) ? 1 : 0;
+    for (int section = numberOfSections - 1; section >= 0; section--) {
+        result |= balancingMasks[choice[section][top]] << section*5;
+        top = previousTop[section][top];
+    }
+    return result;
+}
+
+//----------------------------------------------------------------------------
+// checks if cell voltages moved out of the hysteresis band since the last
+// evaluation of the balanced cells
+
+bool bq769x0::balancingVoltagesChanged()
+{
+    for (int i = 0; i < numberOfCells; i++) {
+        if ((cellPopulationMask & (1 << i)) &&
+            abs(balancingCellVoltage(i) - balancingVoltages[i]) > BALANCING_HYSTERESIS_MV)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+//----------------------------------------------------------------------------
+// true if the current cell voltages are biased by the balancing current, i.e.
+// switches on or not yet settled after the start of a measurement window
+
+bool bq769x0::balancingVoltagesBiased(unsigned long now)
+{
+    return balancingMeasurementInterval_ms > 0 && (balancingStatus != 0 ||
+        (balancingSuspended != 0 && balancingWindowSettled(now) == false));
+}
+
+//----------------------------------------------------------------------------
+// the ADC conversion running at the end of the settle time may have started
+// with the switches on, so the voltages are only unbiased one full conversion
+// period later
+
+bool bq769x0::balancingWindowSettled(unsigned long now)
+{
+    return now - balancingWindowStart >= (unsigned long)balancingSettleTime_ms + CC_PERIOD_MS;
+}
+
+//----------------------------------------------------------------------------
+// cell voltage for balancing decisions (filtered if statistics are attached)
+
+int bq769x0::balancingCellVoltage(int idCell)
+{
+    if (cellStats != NULL && cellStats->isValid(idCell)) {
+        return cellStats->getFiltered(idCell);
+    }
+    return cellVoltages[idCell];
+}
+
+//----------------------------------------------------------------------------
+
+int bq769x0::getBalancingStatus()
 {
     return balancingStatus;
 }
 
 //----------------------------------------------------------------------------
+// time since a reading was last updated, saturated to 16 bit
 
-void bq769x0::setShuntResistorValue(float res_mOhm)
+static uint16_t readingAge(unsigned long now, unsigned long timestamp)
 {
-    shuntResistorValue_mOhm = res_mOhm;
+    unsigned long age = now - timestamp;
+    return (age < READING_AGE_UNKNOWN) ? age : READING_AGE_UNKNOWN;
 }
 
 //----------------------------------------------------------------------------
+// writes the current state to the inactive snapshot buffer and activates it
+// afterwards, so that readers never see a partially written snapshot
 
-void bq769x0::setThermistorBetaValue(int beta_K)
+void bq769x0::publishSnapshot()
 {
-    thermistorBetaValue = beta_K;
+    uint32_t sequence = snapshotSequence + 1;
+    BatterySnapshot *s = &snapshots[sequence & 1];
+
+    s->sequence = sequence;
+    s->timestamp = _timer.read_ms();
+    memcpy(s->cellVoltages, cellVoltages, sizeof(s->cellVoltages));
+    s->idCellMaxVoltage = idCellMaxVoltage;
+    s->idCellMinVoltage = idCellMinVoltage;
+    s->connectedCells = connectedCells;
+    s->batVoltage = batVoltage;
+    s->batCurrent = batCurrent;
+    memcpy(s->temperatures, temperatures, sizeof(s->temperatures));
+    s->coulombCounter = coulombCounter;
+    s->sysStat = regCache[SYS_STAT];
+    s->errorStatus = errorStatus;
+    s->balancingStatus = balancingStatus;
+    s->numberOfCells = numberOfCells;
+    s->numberOfThermistors = numberOfCells/5;
+
+    s->cellVoltagesValid = cellVoltagesValid;
+    s->temperaturesValid = temperaturesValid;
+    for (int i = 0; i < MAX_NUMBER_OF_CELLS; i++) {
+        s->cellVoltageAge[i] = readingAge(s->timestamp, cellVoltageTimestamp[i]);
+    }
+    for (int i = 0; i < MAX_NUMBER_OF_THERMISTORS; i++) {
+        s->temperatureAge[i] = readingAge(s->timestamp, temperatureTimestamp[i]);
+    }
+    s->batVoltageAge = readingAge(s->timestamp, batVoltageTimestamp);
+    s->batCurrentAge = ccTimestampValid ? readingAge(s->timestamp, ccTimestamp) : READING_AGE_UNKNOWN;
+    s->chargeCurrentLimit = chargeCurrentLimit;
+    s->dischargeCurrentLimit = dischargeCurrentLimit;
+
+    __DMB();    // snapshot must be complete before it becomes visible
+    snapshotSequence = sequence;
 }
 
 //----------------------------------------------------------------------------
+// lock-free copy of the latest snapshot, repeated if a new one was published
+// while copying (only possible if the reader was interrupted twice)
 
-void bq769x0::setBatteryCapacity(long capacity_mAh)
+BatterySnapshot bq769x0::getSnapshot()
+{
+    BatterySnapshot snapshot;
+    uint32_t sequence;
+
+    do {
+        sequence = snapshotSequence;
+        __DMB();
+        memcpy(&snapshot, &snapshots[sequence & 1], sizeof(snapshot));
+        __DMB();
+    } while (sequence != snapshotSequence || snapshot.sequence != sequence);
+
+    return snapshot;
+}
+
+//----------------------------------------------------------------------------
+
+void bq769x0::setResistanceEstimation(int stepThreshold_mA, float forgettingFactor)
+{
+    resistanceStepThreshold = stepThreshold_mA;
+    resistanceForgetting = forgettingFactor;
+    resistanceState = RESISTANCE_IDLE;
+    resistanceRefValid = false;
+}
+
+//----------------------------------------------------------------------------
+
+float bq769x0::getCellResistance(int idCell)
+{
+    if (idCell >= 1 && idCell <= numberOfPopulatedCells) {
+        return cellResistance[cellMap[idCell-1]];
+    }
+    return 0;
+}
+
+//----------------------------------------------------------------------------
+
+int bq769x0::getResistanceSamples()
+{
+    return resistanceSamples;
+}
+
+//----------------------------------------------------------------------------
+// log is written after each update (NULL to disable)
+
+void bq769x0::attachLog(bq769x0Log *log)
+{
+    telemetryLog = log;
+}
+
+//----------------------------------------------------------------------------
+
+void bq769x0::attachSocEstimator(bq769x0Soc *estimator)
 {
-    nominalCapacity = capacity_mAh * 3600;
+    socEstimator = estimator;
 }
 
 //----------------------------------------------------------------------------
 
-void bq769x0::setOCV(int voltageVsSOC[NUM_OCV_POINTS])
+void bq769x0::attachCellStats(bq769x0CellStats *stats)
 {
-    OCV = voltageVsSOC;
+    cellStats = stats;
+}
+
+//----------------------------------------------------------------------------
+
+void bq769x0::setShuntResistorValue(float res_mOhm)
+{
+    shuntResistorValue_mOhm = res_mOhm;
+
+    // CC LSB is 8.44 uV
+    currentScale = 8.44 / res_mOhm * 65536 + 0.5;
+
+    // keeps the charge, e.g. set by resetSOC() before the shunt was known
+    setCoulombCounter(coulombCounter);
+}
+
+//----------------------------------------------------------------------------
+
+void bq769x0::setThermistorBetaValue(int beta_K)
+{
+    thermistorBetaValue = beta_K;
+    calculateThermistorTable();
+}
+
+//----------------------------------------------------------------------------
+
+void bq769x0::setBatteryCapacity(long capacity_mAh)
+{
+    nominalCapacity = (int64_t)capacity_mAh * 3600;
+}
+
+//----------------------------------------------------------------------------
+
+void bq769x0::setOCV(const int voltageVsSOC[NUM_OCV_POINTS])
+{
+    memcpy(OCV, voltageVsSOC, sizeof(OCV));
+}
+
+//----------------------------------------------------------------------------
+
+float bq769x0::getSOC(void)
+{
+    if (nominalCapacity <= 0) {
+        return 0;
+    }
+    // only one float operation: 0.0001 % resolution calculated with integers
+    return (coulombCounter * 1000000 / nominalCapacity) * 0.0001f;
+}
+
+//----------------------------------------------------------------------------
+// SOC calculation based on average cell open circuit voltage
+
+void bq769x0::resetSOC(int percent)
+{
+    int64_t charge = 0;  // mAs, initialize with totally depleted battery (0% SOC)
+
+    if (percent <= 100 && percent >= 0)
+    {
+        charge = nominalCapacity * percent / 100;
+        if (socEstimator != NULL) {
+            socEstimator->reset(percent);   // known SOC, e.g. after full charge
+        }
+    }
+    else if (socEstimator != NULL && socEstimator->isInitialized())
+    {
+        charge = nominalCapacity * socEstimator->getSOC() / 100;
+    }
+    else if (OCV[0] > 0 && getNumberOfConnectedCells() > 0)   // reset based on OCV
+    {
+        int voltage = getBatteryVoltage() / getNumberOfConnectedCells();
+
+        if (voltage >= OCV[0]) {
+            charge = nominalCapacity;  // 100% full
+        }
+        else if (voltage > OCV[NUM_OCV_POINTS - 1]) {
+            // binary search for OCV[i] <= voltage < OCV[i-1] (descending values)
+            int low = 1;
+            int high = NUM_OCV_POINTS - 1;
+            while (low < high) {
+                int mid = (low + high) / 2;
+                if (OCV[mid] <= voltage) {
+                    high = mid;
+                }
+                else {
+                    low = mid + 1;
+                }
+            }
+            int i = low;
+
+            // interpolate between OCV[i] and OCV[i-1]
+            charge = nominalCapacity * (NUM_OCV_POINTS - 1 - i) / (NUM_OCV_POINTS - 1) +
+                nominalCapacity * (voltage - OCV[i]) / ((OCV[i-1] - OCV[i]) * (NUM_OCV_POINTS - 1));
+        }
+    }
+    else
+    {
+        return;     // no OCV data available
+    }
+
+    setCoulombCounter(charge);
+    BQ769X0_TRACE(BQ769X0_TRACE_INFO, TRACE_SOC_RESET, (int32_t)(charge / 3600));
+}
+
+//----------------------------------------------------------------------------
+// converts charge to the internal raw CC accumulator
+
+void bq769x0::setCoulombCounter(int64_t charge_mAs)
+{
+    if (socEstimator != NULL) {
+        socEstimator->shiftCoulombCounter(charge_mAs - coulombCounter);
+    }
+    coulombCounter = charge_mAs;
+    if (currentScale > 0) {
+        ccAccumulator = (charge_mAs * 1000 << 16) / currentScale;
+    }
+}
+
+//----------------------------------------------------------------------------
+// stores the current CC reading as zero current offset (should be called when
+// no current is flowing, e.g. with both FETs switched off)
+
+void bq769x0::calibrateCurrentOffset()
+{
+    ccOffset = ccRaw;
+}
+
+//----------------------------------------------------------------------------
+
+void bq769x0::setCurrentOffset(int offset_LSB)
+{
+    ccOffset = offset_LSB;
+}
+
+//----------------------------------------------------------------------------
+
+int bq769x0::getCurrentOffset()
+{
+    return ccOffset;
+}
+
+//----------------------------------------------------------------------------
+
+unsigned long bq769x0::getMissedCCReadings()
+{
+    return missedCCReadings;
+}
+
+//----------------------------------------------------------------------------
+
+DriverStats bq769x0::getStats()
+{
+    DriverStats s = stats;
+    s.missedCCReadings = missedCCReadings;
+    if (s.update.count > 0) {
+        s.update.avg_us = updateTimeSum_us / s.update.count;
+    }
+    if (s.checkStatus.count > 0) {
+        s.checkStatus.avg_us = checkStatusTimeSum_us / s.checkStatus.count;
+    }
+    return s;
+}
+
+//----------------------------------------------------------------------------
+
+void bq769x0::resetStats()
+{
+    memset(&stats, 0, sizeof(stats));
+    updateTimeSum_us = 0;
+    checkStatusTimeSum_us = 0;
+}
+
+//----------------------------------------------------------------------------
+// adds the duration since start_us to the timing statistics
+
+void bq769x0::recordTiming(TimingStats& timing, uint64_t& sum_us, int start_us)
+{
+    uint32_t duration_us = (uint32_t)(_timer.read_us() - start_us);
+
+    timing.count++;
+    sum_us += duration_us;
+    if (duration_us > timing.max_us) {
+        timing.max_us = duration_us;
+    }
+
+    // logarithmic bins starting at 500 us
+    int bin = 0;
+    while (bin < NUM_TIMING_HISTOGRAM_BINS - 1 && duration_us >= (500UL << bin)) {
+        bin++;
+    }
+    timing.histogram[bin]++;
+}
+
+//----------------------------------------------------------------------------
+
+void bq769x0::setTemperatureLimits(int minDischarge_degC, int maxDischarge_degC,
+  int minCharge_degC, int maxCharge_degC, int hysteresis_degC)
+{
+    // Temperature limits (°C/10)
+    minCellTempDischarge = minDischarge_degC * 10;
+    maxCellTempDischarge = maxDischarge_degC * 10;
+    minCellTempCharge = minCharge_degC * 10;
+    maxCellTempCharge = maxCharge_degC * 10;
+    cellTempHysteresis = hysteresis_degC * 10;
+    calculateDeratingCurves();
+}
+
+//----------------------------------------------------------------------------
+
+void bq769x0::setCurrentLimits(long maxCharge_mA, long maxDischarge_mA)
+{
+    maxChargeCurrent = maxCharge_mA;
+    maxDischargeCurrent = maxDischarge_mA;
+}
+
+//----------------------------------------------------------------------------
+
+long bq769x0::getChargeCurrentLimit()
+{
+    return chargeCurrentLimit;
+}
+
+//----------------------------------------------------------------------------
+
+long bq769x0::getDischargeCurrentLimit()
+{
+    return dischargeCurrentLimit;
+}
+//----------------------------------------------------------------------------
+
+void bq769x0::setIdleCurrentThreshold(int current_mA)
+{
+    idleCurrentThreshold = current_mA;
+}
+
+//----------------------------------------------------------------------------
+
+long bq769x0::setShortCircuitProtection(long current_mA, int delay_us)
+{
+    regPROTECT1_t protect1;
+
+    // only RSNS = 1 considered
+    protect1.regByte = protect1Register(current_mA, delay_us, shuntResistorValue_mOhm);
+    updateRegister(PROTECT1, protect1.regByte);
+
+    // returns the actual current threshold value
+    return (long)SCD_threshold_setting[protect1.bits.SCD_THRESH] * 1000 /
+        shuntResistorValue_mOhm;
+}
+
+//----------------------------------------------------------------------------
+
+long bq769x0::setOvercurrentChargeProtection(long current_mA, int delay_ms)
+{
+    // The bq769x0 does not provide charge overcurrent protection, so it is
+    // implemented in software based on the CC readings (see updateCurrent).
+    // Delay settings are the same as for OCD, but the resulting delay is a
+    // multiple of the CC period.
+
+    int delaySetting = protectionSetting(OCD_delay_setting, delay_ms);
+
+    occThreshold_mA = (current_mA > 0) ? current_mA : 0;    // 0 = disabled
+    occDelayPeriods = (OCD_delay_setting[delaySetting] + CC_PERIOD_MS - 1) / CC_PERIOD_MS;
+    occPeriods = 0;
+
+    return occThreshold_mA;
+}
+
+//----------------------------------------------------------------------------
+
+long bq769x0::setOvercurrentDischargeProtection(long current_mA, int delay_ms)
+{
+    regPROTECT2_t protect2;
+
+    // Remark: RSNS must be set to 1 in PROTECT1 register
+    protect2.regByte = protect2Register(current_mA, delay_ms, shuntResistorValue_mOhm);
+    updateRegister(PROTECT2, protect2.regByte);
+
+    // returns the actual current threshold value
+    return (long)OCD_threshold_setting[protect2.bits.OCD_THRESH] * 1000 /
+        shuntResistorValue_mOhm;
+}
+
+
+//----------------------------------------------------------------------------
+
+int bq769x0::setCellUndervoltageProtection(int voltage_mV, int delay_s)
+{
+    regPROTECT3_t protect3;
+    int uv_trip = uvTripRegister(voltage_mV);
+
+    minCellVoltage = voltage_mV;
+    calculateDeratingCurves();
+    updateRegister(UV_TRIP, uv_trip);
+
+    // OV delay is kept, reset value of the IC used if unknown
+    int value = readShadowRegister(PROTECT3);
+    protect3.regByte = (value < 0) ? 0 : value;
+    protect3.bits.UV_DELAY = protectionSetting(UV_delay_setting, delay_s);
+    updateRegister(PROTECT3, protect3.regByte);
+
+    // returns the actual current threshold value
+    return ((long)1 << 12 | uv_trip << 4) * adcGain / 1000 + adcOffset;
+}
+
+//----------------------------------------------------------------------------
+
+int bq769x0::setCellOvervoltageProtection(int voltage_mV, int delay_s)
+{
+    regPROTECT3_t protect3;
+    int ov_trip = ovTripRegister(voltage_mV);
+
+    maxCellVoltage = voltage_mV;
+    calculateDeratingCurves();
+    updateRegister(OV_TRIP, ov_trip);
+
+    // UV delay is kept, reset value of the IC used if unknown
+    int value = readShadowRegister(PROTECT3);
+    protect3.regByte = (value < 0) ? 0 : value;
+    protect3.bits.OV_DELAY = protectionSetting(OV_delay_setting, delay_s);
+    updateRegister(PROTECT3, protect3.regByte);
+
+    // returns the actual current threshold value
+    return ((long)1 << 13 | ov_trip << 4) * adcGain / 1000 + adcOffset;
+}
+
+//----------------------------------------------------------------------------
+// OV_TRIP and UV_TRIP contain bits 4-11 of the 14-bit ADC value of the
+// threshold (bits 12-13 fixed to 10 for OV and 01 for UV)
+
+int bq769x0::ovTripRegister(int voltage_mV)
+{
+    return ((((long)voltage_mV - adcOffset) * 1000 / adcGain) >> 4) & 0x00FF;
+}
+
+//----------------------------------------------------------------------------
+
+int bq769x0::uvTripRegister(int voltage_mV)
+{
+    int uv_trip = ((((long)voltage_mV - adcOffset) * 1000 / adcGain) >> 4) & 0x00FF;
+
+    // always round up for lower cell voltage
+    return (uv_trip < 0xFF) ? uv_trip + 1 : uv_trip;
+}
+
+//----------------------------------------------------------------------------
+
+bool bq769x0::applyProtectionProfile(const ProtectionProfile& profile)
+{
+    return applyProtectionProfile(profile,
+        resolveProtectionRegisters(profile, shuntResistorValue_mOhm));
+}
+
+//----------------------------------------------------------------------------
+
+bool bq769x0::applyProtectionProfile(const ProtectionProfile& profile,
+    const ProtectionRegisters& registers)
+{
+    uint8_t values[UV_TRIP - PROTECT1 + 1];
+    uint8_t readback[sizeof(values)];
+
+    values[0] = registers.protect1;
+    values[1] = registers.protect2;
+    values[2] = registers.protect3;
+    values[OV_TRIP - PROTECT1] = ovTripRegister(profile.cellOvervoltage_mV);
+    values[UV_TRIP - PROTECT1] = uvTripRegister(profile.cellUndervoltage_mV);
+
+    // software limits
+    minCellVoltage = profile.cellUndervoltage_mV;
+    maxCellVoltage = profile.cellOvervoltage_mV;
+    setOvercurrentChargeProtection(profile.chargeCurrent_mA, profile.chargeCurrentDelay_ms);
+    setTemperatureLimits(profile.minDischargeTemp_degC, profile.maxDischargeTemp_degC,
+        profile.minChargeTemp_degC, profile.maxChargeTemp_degC, profile.tempHysteresis_degC);
+    setBalancingThresholds(profile.balancingIdleTime_min, profile.balancingMinVoltage_mV,
+        profile.balancingMaxVoltageDifference_mV);
+
+    return writeRegisters(PROTECT1, values, sizeof(values)) &&
+        readRegisters(PROTECT1, readback, sizeof(readback)) &&
+        memcmp(values, readback, sizeof(values)) == 0;
+}
+
+
+//----------------------------------------------------------------------------
+
+int bq769x0::getBatteryCurrent()
+{
+    return batCurrent;
+}
+
+//----------------------------------------------------------------------------
+
+int bq769x0::getBatteryVoltage()
+{
+    return batVoltage;
+}
+
+//----------------------------------------------------------------------------
+
+int bq769x0::getMaxCellVoltage()
+{
+    return cellVoltages[idCellMaxVoltage];
+}
+
+//----------------------------------------------------------------------------
+
+int bq769x0::getMinCellVoltage()
+{
+    return cellVoltages[idCellMinVoltage];
+}
+
+//----------------------------------------------------------------------------
+
+int bq769x0::getCellVoltage(int idCell)
+{
+    if (idCell >= 1 && idCell <= numberOfPopulatedCells) {
+        return cellVoltages[cellMap[idCell-1]];
+    }
+    return 0;
+}
+
+//----------------------------------------------------------------------------
+
+int bq769x0::getAvgCellVoltage()
+{
+    return avgCellVoltage;
+}
+
+//----------------------------------------------------------------------------
+// bit n of mask set if cell n+1 is physically connected, getCellVoltage()
+// then only counts the populated cells (mask 0: all cells of the IC)
+
+void bq769x0::setCellPopulationMask(unsigned int mask)
+{
+    mask &= (1 << numberOfCells) - 1;
+    if (mask == 0) {
+        mask = (1 << numberOfCells) - 1;
+    }
+    cellPopulationMask = mask;
+
+    numberOfPopulatedCells = 0;
+    for (int i = 0; i < numberOfCells; i++) {
+        if (mask & (1 << i)) {
+            cellMap[numberOfPopulatedCells++] = i;
+        }
+        else {
+            cellVoltages[i] = 0;
+        }
+    }
+
+    calculateCacheBlocks();
+}
+
+//----------------------------------------------------------------------------
+// determines the populated cells by reading all cell voltages once
+// (ADC needs to be enabled for at least 250 ms before)
+
+unsigned int bq769x0::learnCellPopulation()
+{
+    unsigned int mask = 0;
+
+    setCellPopulationMask(0);
+    if (updateRegisterCache()) {
+        updateVoltages();
+        for (int i = 0; i < numberOfCells; i++) {
+            if (cellVoltages[i] > 500) {
+                mask |= 1 << i;
+            }
+        }
+    }
+    setCellPopulationMask(mask);
+
+    return cellPopulationMask;
+}
+
+//----------------------------------------------------------------------------
+
+unsigned int bq769x0::getCellPopulationMask()
+{
+    return cellPopulationMask;
+}
+
+//----------------------------------------------------------------------------
+
+int bq769x0::getNumberOfPopulatedCells(void)
+{
+    return numberOfPopulatedCells;
+}
+
+//----------------------------------------------------------------------------
+
+int bq769x0::getNumberOfCells(void)
+{
+    return numberOfCells;
+}
+
+//----------------------------------------------------------------------------
+
+int bq769x0::getNumberOfConnectedCells(void)
+{
+    return connectedCells;
+}
+
+//----------------------------------------------------------------------------
+
+float bq769x0::getTemperatureDegC(int channel)
+{
+    if (channel >= 1 && channel <= numberOfCells/5) {
+        return (float)temperatures[channel-1] / 10.0;
+    }
+    else {
+        return -273.15;   // Error: Return absolute minimum temperature
+    }
+}
+
+//----------------------------------------------------------------------------
+
+float bq769x0::getTemperatureDegF(int channel)
+{
+    return getTemperatureDegC(channel) * 1.8 + 32;
+}
+
+
+//----------------------------------------------------------------------------
+
+void bq769x0::updateTemperatures()
+{
+    int numberOfThermistors = numberOfCells/5;
+    unsigned long now = _timer.read_ms();
+
+    temperaturesValid = 0;
+    for (int i = 0; i < numberOfThermistors; i++) {
+        if (!isCacheValid(TS1_HI_BYTE + i*2) || !isCacheValid(TS1_LO_BYTE + i*2)) {
+            continue;   // keep last value
+        }
+        temperatureTimestamp[i] = now;
+        temperaturesValid |= 1 << i;
+        temperaturesReceived |= 1 << i;
+
+        int adcVal = (regCache[TS1_HI_BYTE + i*2] & 0b00111111) << 8 | regCache[TS1_LO_BYTE + i*2];
+
+        // linear interpolation between table points
+        int index = adcVal >> THERMISTOR_TABLE_STEP_BITS;
+        int fraction = adcVal & ((1 << THERMISTOR_TABLE_STEP_BITS) - 1);
+        temperatures[i] = thermistorTable[index] +
+            (((thermistorTable[index + 1] - thermistorTable[index]) * fraction) >> THERMISTOR_TABLE_STEP_BITS);
+    }
+
+    // all thermistors of the IC, readings not received keep their last value
+    // (channels without any reading yet are skipped)
+    bool first = true;
+    for (int i = 0; i < numberOfThermistors; i++) {
+        if ((temperaturesReceived & (1 << i)) == 0) {
+            continue;
+        }
+        if (first || temperatures[i] < minTemperature) {
+            minTemperature = temperatures[i];
+        }
+        if (first || temperatures[i] > maxTemperature) {
+            maxTemperature = temperatures[i];
+        }
+        first = false;
+    }
+
+    if (temperaturesReceived != 0) {
+        checkTemperatureLimits();   // previous verdict kept until first reading
+    }
+}
+
+//----------------------------------------------------------------------------
+// pre-calculates temperatures (°C/10) for equally spaced TS ADC values, so that
+// updateTemperatures() only needs integer operations
+
+void bq769x0::calculateThermistorTable()
+{
+    for (int i = 0; i < NUM_THERMISTOR_TABLE_POINTS; i++)
+    {
+        // calculate R_thermistor according to bq769x0 datasheet
+        float vtsx = (i << THERMISTOR_TABLE_STEP_BITS) * 0.382; // mV
+        float tmp;
+
+        if (vtsx <= 0.0) {
+            tmp = 150.0 + 273.15;   // thermistor shorted
+        }
+        else if (vtsx >= 3300.0) {
+            tmp = -50.0 + 273.15;   // thermistor open
+        }
+        else {
+            float rts = 10000.0 * vtsx / (3300.0 - vtsx); // Ohm
+
+            // Temperature calculation using Beta equation
+            // - According to bq769x0 datasheet, only 10k thermistors should be used
+            // - 25°C reference temperature for Beta equation assumed
+            tmp = 1.0/(1.0/(273.15+25) + 1.0/thermistorBetaValue*log(rts/10000.0)); // K
+        }
+
+        // limit to range of thermistors
+        if (tmp > 150.0 + 273.15) {
+            tmp = 150.0 + 273.15;
+        }
+        else if (tmp < -50.0 + 273.15) {
+            tmp = -50.0 + 273.15;
+        }
+        thermistorTable[i] = (tmp - 273.15) * 10.0;
+    }
+}
+
+//----------------------------------------------------------------------------
+
+void bq769x0::updateCurrent()
+{
+    regSYS_STAT_t sys_stat;
+    sys_stat.regByte = regCache[SYS_STAT];
+
+    if (!isCacheValid(SYS_STAT) || !isCacheValid(CC_HI_BYTE) || !isCacheValid(CC_LO_BYTE)) {
+        return;     // CC_READY is still set, so the reading is used next time
+    }
+
+    // check if new current reading available
+    if (sys_stat.bits.CC_READY == 1)
+    {
+        unsigned long now = _timer.read_ms();
+        unsigned long elapsed = CC_PERIOD_MS;
+        int periods = 1;
+
+        ccRaw = (int16_t)((regCache[CC_HI_BYTE] << 8) | regCache[CC_LO_BYTE]);
+        int adcVal = ccRaw - ccOffset;
+        batCurrent = ((int64_t)adcVal * currentScale) >> 16;  // mA
+
+        // The reading is integrated over the time since the previous one, as
+        // the polling interval varies. A reading was only missed if at least
+        // two full periods passed, and missed readings are assumed to have the
+        // same value as this one.
+        if (ccTimestampValid) {
+            elapsed = now - ccTimestamp;
+            periods = elapsed / CC_PERIOD_MS;
+            if (periods < 1) {
+                periods = 1;
+            }
+            if (powerState == POWER_NORMAL) {
+                missedCCReadings += periods - 1;    // expected in low-power mode
+            }
+        }
+        ccTimestamp = now;
+        ccTimestampValid = true;
+
+        // integrate raw values to avoid rounding errors
+        ccAccumulator += (int64_t)adcVal * elapsed;
+        coulombCounter = ((ccAccumulator * currentScale) >> 16) / 1000;
+
+        checkOvercurrentCharge(periods);
+
+        // reduce resolution for actual current value
+        if (batCurrent > -10 && batCurrent < 10) {
+            batCurrent = 0;
+        }
+
+        detectCurrentStep(periods);
+
+        // reset idleTimestamp and wake up from low-power mode
+        if (abs(batCurrent) > idleCurrentThreshold) {
+            idleTimestamp = _timer.read_ms();
+            exitLowPower();
+        }
+
+        // no error occured which caused alert (software protection errors are
+        // handled by the next checkStatus(), which schedules their recovery)
+        if (!(sys_stat.regByte & 0b00111111) && softwareErrors == 0) {
+            alertInterruptFlag = false;
+        }
+
+        writeRegister(SYS_STAT, 0b10000000);  // Clear CC ready flag
+        regCache[SYS_STAT] &= ~STAT_CC_READY;   // don't count this reading twice
+    }
 }
 
 //----------------------------------------------------------------------------
+// software charge overcurrent protection, evaluated with each new CC reading
+// so that the reaction time is at most one CC period after the delay
 
-float bq769x0::getSOC(void)
+void bq769x0::checkOvercurrentCharge(int periods)
 {
-    return (double) coulombCounter / nominalCapacity * 100;
+    if (occThreshold_mA == 0 || (softwareErrors & BQ769X0_ERR_OCC)) {
+        return;
+    }
+
+    if (batCurrent > occThreshold_mA) {
+        occPeriods += periods;  // missed readings assumed to have the same value
+        if (occPeriods >= occDelayPeriods) {
+            // switch CHG off based on shadow register, no read necessary
+            writeRegister(SYS_CTRL2, regShadow[SYS_CTRL2] & ~0b00000001);
+            softwareErrors |= BQ769X0_ERR_OCC;
+            errorStatus |= BQ769X0_ERR_OCC;
+            alertInterruptFlag = true;  // schedule recovery in next checkStatus()
+            BQ769X0_TRACE(BQ769X0_TRACE_WARNING, TRACE_OCC, batCurrent);
+        }
+    }
+    else {
+        occPeriods = 0;
+    }
 }
 
 //----------------------------------------------------------------------------
-// SOC calculation based on average cell open circuit voltage
+// step detection for the resistance estimation, evaluated with each new CC
+// reading: the reading containing the step is an average over the transition,
+// so the voltages are taken after the following (settled) reading
 
-void bq769x0::resetSOC(int percent)
+void bq769x0::detectCurrentStep(int periods)
 {
-    if (percent <= 100 && percent >= 0)
-    {
-        coulombCounter = nominalCapacity * (percent / 100.0);
+    if (resistanceStepThreshold == 0) {
+        return;
+    }
+
+    if (periods > 1) {
+        // timing of the step unknown if readings were missed
+        resistanceState = RESISTANCE_IDLE;
+        resistanceRefValid = false;
+        return;
     }
-    else  // reset based on OCV
-    {
-        printf("NumCells: %d, voltage: %d V\n", getNumberOfConnectedCells(), getBatteryVoltage());
-        int voltage = getBatteryVoltage() / getNumberOfConnectedCells();
 
-        coulombCounter = 0;  // initialize with totally depleted battery (0% SOC)
+    bool step = labs(batCurrent - resistanceRefCurrent) >= resistanceStepThreshold;
 
-        for (int i = 0; i < NUM_OCV_POINTS; i++)
-        {
-            if (OCV[i] <= voltage) {
-                if (i == 0) {
-                    coulombCounter = nominalCapacity;  // 100% full
-                }
-                else {
-                    // interpolate between OCV[i] and OCV[i-1]
-                    coulombCounter = (double) nominalCapacity / (NUM_OCV_POINTS - 1.0) *
-                    (NUM_OCV_POINTS - 1.0 - i + ((float)voltage - OCV[i])/(OCV[i-1] - OCV[i]));
-                }
-                return;
-            }
+    switch (resistanceState) {
+    case RESISTANCE_IDLE:
+        if (step && resistanceRefValid) {
+            resistanceState = RESISTANCE_STEP;
         }
+        break;
+    case RESISTANCE_STEP:
+        resistanceState = step ? RESISTANCE_MEASURE : RESISTANCE_IDLE;
+        break;
+    case RESISTANCE_MEASURE:
+        // voltages of the settled period were not read in time
+        resistanceState = RESISTANCE_IDLE;
+        resistanceRefValid = false;
+        break;
     }
 }
 
 //----------------------------------------------------------------------------
+// evaluates a measurement after a current step or stores the voltages as
+// reference for the next step (only readings of all cells without balancing)
 
-void bq769x0::setTemperatureLimits(int minDischarge_degC, int maxDischarge_degC,
-  int minCharge_degC, int maxCharge_degC, int hysteresis_degC)
+void bq769x0::updateCellResistance()
 {
-    // Temperature limits (°C/10)
-    minCellTempDischarge = minDischarge_degC * 10;
-    maxCellTempDischarge = maxDischarge_degC * 10;
-    minCellTempCharge = minCharge_degC * 10;
-    maxCellTempCharge = maxCharge_degC * 10;
-    cellTempHysteresis = hysteresis_degC * 10;
+    bool usable = balancingStatus == 0 && balancingSuspended == 0 &&
+        (cellVoltagesValid & cellPopulationMask) == cellPopulationMask;
+
+    if (resistanceState == RESISTANCE_MEASURE) {
+        resistanceState = RESISTANCE_IDLE;
+        if (usable && resistanceRefValid) {
+            float dI = (batCurrent - resistanceRefCurrent) / 1000.0f;     // A
+            for (int j = 0; j < numberOfPopulatedCells; j++) {
+                int i = cellMap[j];
+                float dV = cellVoltages[i] - resistanceRefVoltages[i];   // mV
+
+                // scalar RLS for dV = R * dI
+                float p = cellResistanceCovariance[i];
+                float gain = p * dI / (resistanceForgetting + dI * p * dI);
+                cellResistance[i] += gain * (dV - cellResistance[i] * dI);
+                cellResistanceCovariance[i] = (p - gain * dI * p) / resistanceForgetting;
+            }
+            resistanceSamples++;
+        }
+    }
+
+    if (resistanceState == RESISTANCE_IDLE) {
+        resistanceRefValid = usable;
+        resistanceRefCurrent = batCurrent;
+        for (int i = 0; i < numberOfCells; i++) {
+            resistanceRefVoltages[i] = cellVoltages[i];
+        }
+    }
 }
 
 //----------------------------------------------------------------------------
+// reads all cell voltage registers with one burst outside of the regular
+// updates (registers not received keep their previous value)
 
-void bq769x0::setIdleCurrentThreshold(int current_mA)
+void bq769x0::readCellVoltages()
 {
-    idleCurrentThreshold = current_mA;
+    uint64_t valid = 0;
+    int length = numberOfCells * 2;
+    uint64_t mask = (((uint64_t)1 << length) - 1) << VC1_HI_BYTE;
+
+    readRegisters(VC1_HI_BYTE, &regCache[VC1_HI_BYTE], length, &valid);
+    regCacheValid = (regCacheValid & ~mask) | (valid << VC1_HI_BYTE);
+    updateVoltages();
 }
 
 //----------------------------------------------------------------------------
+// reads all cell voltages from register cache to array cellVoltages[NUM_CELLS]
+// and updates batVoltage (cells not populated according to mask are skipped)
 
-long bq769x0::setShortCircuitProtection(long current_mA, int delay_us)
+void bq769x0::updateVoltages()
 {
-    regPROTECT1_t protect1;
+    long adcVal = 0;
+    int connectedCellsTemp = 0;
+    long sum = 0;
+    unsigned long now = _timer.read_ms();
+    bool statsUpdate = (cellStats != NULL && balancingVoltagesBiased(now) == false);
+
+    cellVoltagesValid = 0;
+    idCellMaxVoltage = cellMap[0];
+    idCellMinVoltage = cellMap[0];
+    for (int j = 0; j < numberOfPopulatedCells; j++)
+    {
+        int i = cellMap[j];
+
+        // keep last value if the registers were not received correctly
+        if (isCacheValid(VC1_HI_BYTE + i*2) && isCacheValid(VC1_LO_BYTE + i*2)) {
+            adcVal = (regCache[VC1_HI_BYTE + i*2] & 0b00111111) << 8 | regCache[VC1_LO_BYTE + i*2];
+            cellVoltages[i] = ((adcVal * cellVoltageScale) >> 16) + adcOffset;
+            cellVoltageTimestamp[i] = now;
+            cellVoltagesValid |= 1 << i;
+            if (statsUpdate) {
+                cellStats->update(i, cellVoltages[i], now);
+            }
+        }
 
-    // only RSNS = 1 considered
-    protect1.bits.RSNS = 1;
+        if (cellVoltages[i] > 500) {
+            connectedCellsTemp++;
+            sum += cellVoltages[i];
+        }
 
-    protect1.bits.SCD_THRESH = 0;
-    for (int i = sizeof(SCD_threshold_setting)-1; i > 0; i--) {
-        if (current_mA * shuntResistorValue_mOhm / 1000 >= SCD_threshold_setting[i]) {
-            protect1.bits.SCD_THRESH = i;
-            break;
+        if (cellVoltages[i] > cellVoltages[idCellMaxVoltage]) {
+            idCellMaxVoltage = i;
+        }
+        if ((cellVoltages[i] < cellVoltages[idCellMinVoltage] || cellVoltages[idCellMinVoltage] <= 500)
+            && cellVoltages[i] > 500) {
+            idCellMinVoltage = i;
         }
     }
+    connectedCells = connectedCellsTemp;
+    avgCellVoltage = (connectedCells > 0) ? sum / connectedCells : 0;
 
-    protect1.bits.SCD_DELAY = 0;
-    for (int i = sizeof(SCD_delay_setting)-1; i > 0; i--) {
-        if (delay_us >= SCD_delay_setting[i]) {
-            protect1.bits.SCD_DELAY = i;
-            break;
-        }
+    if (statsUpdate) {
+        cellStats->updateMean(cellPopulationMask);
     }
 
-    writeRegister(PROTECT1, protect1.regByte);
+    if (resistanceStepThreshold > 0) {
+        updateCellResistance();
+    }
 
-    // returns the actual current threshold value
-    return (long)SCD_threshold_setting[protect1.bits.SCD_THRESH] * 1000 /
-        shuntResistorValue_mOhm;
+    // battery pack voltage
+    if (isCacheValid(BAT_HI_BYTE) && isCacheValid(BAT_LO_BYTE)) {
+        adcVal = (regCache[BAT_HI_BYTE] << 8) | regCache[BAT_LO_BYTE];
+        batVoltage = (long)(((uint32_t)adcVal * batVoltageScale) >> 14) + connectedCells * adcOffset;
+        batVoltageTimestamp = now;
+    }
 }
 
 //----------------------------------------------------------------------------
+// writes a single register, repeated within the retry budget if the IC does
+// not acknowledge
 
-long bq769x0::setOvercurrentChargeProtection(long current_mA, int delay_ms)
+bool bq769x0::writeRegister(int address, int data)
 {
-    // ToDo: Software protection for charge overcurrent
-    return 0;
+    uint8_t value = data;
+    return writeRegisters(address, &value, 1);
 }
 
 //----------------------------------------------------------------------------
+// block write of num registers starting at address using the auto-increment
+// feature of the bq769x0
 
-long bq769x0::setOvercurrentDischargeProtection(long current_mA, int delay_ms)
+bool bq769x0::writeRegisters(int address, const uint8_t *data, int num)
 {
-    regPROTECT2_t protect2;
+    char buf[1 + NUM_SHADOW_REGISTERS * 2];
+    int length = 1;
 
-    // Remark: RSNS must be set to 1 in PROTECT1 register
+    if (num < 1 || num > NUM_SHADOW_REGISTERS) {
+        return false;
+    }
+
+    buf[0] = (char) address;
+    for (int i = 0; i < num; i++) {
+        buf[length++] = data[i];
+        if (crcEnabled == true) {
+            // CRC of first byte is calculated over the slave address (including
+            // R/W bit), register address, and data, following ones only over data
+            uint8_t crc = (i == 0) ?
+                _crc8_ccitt_update(_crc8_ccitt_update(crcAddressWrite, buf[0]), data[0]) :
+                _crc8_ccitt_update(0, data[i]);
+            buf[length++] = crc;
+        }
 
-    protect2.bits.OCD_THRESH = 0;
-    for (int i = sizeof(OCD_threshold_setting)-1; i > 0; i--) {
-        if (current_mA * shuntResistorValue_mOhm / 1000 >= OCD_threshold_setting[i]) {
-            protect2.bits.OCD_THRESH = i;
-            break;
+        // shadow contains the requested value even if the write fails, so that it
+        // is corrected by verifyShadowRegisters() later on
+        if (address + i >= CELLBAL1 && address + i < NUM_SHADOW_REGISTERS) {
+            regShadow[address + i] = data[i];
+            regShadowValid |= 1 << (address + i);
         }
     }
 
-    protect2.bits.OCD_DELAY = 0;
-    for (int i = sizeof(OCD_delay_setting)-1; i > 0; i--) {
-        if (delay_ms >= OCD_delay_setting[i]) {
-            protect2.bits.OCD_DELAY = i;
-            break;
+    int start_us = _timer.read_us();
+    for (int attempt = 0; retryAllowed(attempt, start_us); attempt++) {
+        stats.i2cTransactions++;
+        stats.i2cBytes += length;
+        if (busSelect) {
+            busSelect();
         }
+        if (_i2c.write(I2CAddress << 1, buf, length) == 0) {
+            return true;
+        }
+        stats.i2cErrors++;
     }
+    busError();
+    return false;
+}
 
-    writeRegister(PROTECT2, protect2.regByte);
+//----------------------------------------------------------------------------
+// writes control register via its shadow copy, the bus transfer is skipped if
+// the value did not change
 
-    // returns the actual current threshold value
-    return (long)OCD_threshold_setting[protect2.bits.OCD_THRESH] * 1000 /
-        shuntResistorValue_mOhm;
+void bq769x0::updateRegister(int address, int data)
+{
+    if (address >= CELLBAL1 && address < NUM_SHADOW_REGISTERS &&
+        (regShadowValid & (1 << address)) && regShadow[address] == (uint8_t)data)
+    {
+        return;
+    }
+    writeRegister(address, data);
 }
 
-
 //----------------------------------------------------------------------------
+// returns the shadow copy of a control register (only read from IC if unknown,
+// -1 if it could not be read)
 
-int bq769x0::setCellUndervoltageProtection(int voltage_mV, int delay_s)
+int bq769x0::readShadowRegister(int address)
 {
-    regPROTECT3_t protect3;
-    int uv_trip = 0;
+    if (address < CELLBAL1 || address >= NUM_SHADOW_REGISTERS) {
+        return readRegister(address);
+    }
 
-    minCellVoltage = voltage_mV;
+    if ((regShadowValid & (1 << address)) == 0) {
+        int value = readRegister(address);
+        if (value < 0) {
+            return -1;
+        }
+        regShadow[address] = value;
+        regShadowValid |= 1 << address;
+    }
+    return regShadow[address];
+}
 
-    protect3.regByte = readRegister(PROTECT3);
+//----------------------------------------------------------------------------
+// compares the control registers of the last burst read with their shadow
+// copies and restores them if necessary (e.g. after an unexpected IC reset)
+
+void bq769x0::verifyShadowRegisters()
+{
+    for (int address = CELLBAL1; address < NUM_SHADOW_REGISTERS; address++)
+    {
+        if ((regShadowValid & (1 << address)) == 0 || !isCacheValid(address)) {
+            continue;
+        }
 
-    uv_trip = ((((long)voltage_mV - adcOffset) * 1000 / adcGain) >> 4) & 0x00FF;
-    uv_trip += 1;   // always round up for lower cell voltage
-    writeRegister(UV_TRIP, uv_trip);
+        uint8_t actual = regCache[address];
+        if (address == SYS_CTRL1) {
+            // LOAD_PRESENT bit is read-only
+            actual = (actual & ~0b10000000) | (regShadow[address] & 0b10000000);
+        }
+        else if (address == SYS_CTRL2) {
+            // FETs may have been switched off by the protection functions of the IC
+            // and CC_ONESHOT is cleared by the IC after the conversion
+            regShadow[address] &= actual | ~0b00100011;
+        }
 
-    protect3.bits.UV_DELAY = 0;
-    for (int i = sizeof(UV_delay_setting)-1; i > 0; i--) {
-        if (delay_s >= UV_delay_setting[i]) {
-            protect3.bits.UV_DELAY = i;
-            break;
+        if (actual != regShadow[address]) {
+            writeRegister(address, regShadow[address]);
         }
     }
+}
 
-    writeRegister(PROTECT3, protect3.regByte);
+//----------------------------------------------------------------------------
+// reads a single register (returns -1 if no valid value was received within
+// the retry budget)
 
-    // returns the actual current threshold value
-    return ((long)1 << 12 | uv_trip << 4) * adcGain / 1000 + adcOffset;
+int bq769x0::readRegister(int address)
+{
+    uint8_t data;
+
+    if (readRegisters(address, &data, 1)) {
+        return data;
+    }
+    return -1;
 }
 
 //----------------------------------------------------------------------------
+// burst read of num registers starting at address using the auto-increment
+// feature of the bq769x0, repeated within the retry budget until all CRCs are
+// correct. Only registers with correct CRC are stored in data and marked in
+// the optional bit mask valid (bit 0 = address). Returns true if all
+// registers were received.
 
-int bq769x0::setCellOvervoltageProtection(int voltage_mV, int delay_s)
+bool bq769x0::readRegisters(int address, uint8_t *data, int num, uint64_t *valid)
 {
-    regPROTECT3_t protect3;
-    int ov_trip = 0;
-
-    maxCellVoltage = voltage_mV;
+    char buf[NUM_CACHED_REGISTERS * 2];
+    uint64_t all = ((uint64_t)1 << num) - 1;
+    uint64_t received = 0;
+    bool acknowledged = false;
 
-    protect3.regByte = readRegister(PROTECT3);
+    if (num < 1 || num > NUM_CACHED_REGISTERS) {
+        return false;
+    }
 
-    ov_trip = ((((long)voltage_mV - adcOffset) * 1000 / adcGain) >> 4) & 0x00FF;
-    writeRegister(OV_TRIP, ov_trip);
+    int start_us = _timer.read_us();
+    for (int attempt = 0; received != all && retryAllowed(attempt, start_us); attempt++)
+    {
+        if (readRaw(address, buf, crcEnabled ? num * 2 : num) == false) {
+            continue;
+        }
+        acknowledged = true;
 
-    protect3.bits.OV_DELAY = 0;
-    for (int i = sizeof(OV_delay_setting)-1; i > 0; i--) {
-        if (delay_s >= OV_delay_setting[i]) {
-            protect3.bits.OV_DELAY = i;
-            break;
+        uint64_t decoded = decodeRegisters(buf, data, num);
+        if (decoded != all) {
+            if (num == 1) {
+                stats.crcErrorsSingle++;
+            }
+            else {
+                stats.crcErrorsBurst++;
+            }
+            BQ769X0_TRACE(BQ769X0_TRACE_WARNING, TRACE_CRC_ERROR, address);
         }
+        received |= decoded;
     }
 
-    writeRegister(PROTECT3, protect3.regByte);
-
-    // returns the actual current threshold value
-    return ((long)1 << 13 | ov_trip << 4) * adcGain / 1000 + adcOffset;
+    if (acknowledged == false) {
+        busError();
+    }
+    if (valid != NULL) {
+        *valid = received;
+    }
+    return received == all;
 }
 
-
 //----------------------------------------------------------------------------
+// sends the register address and reads length raw bytes (including CRC)
+// (returns false if the IC did not acknowledge)
 
-int bq769x0::getBatteryCurrent()
+bool bq769x0::readRaw(int address, char *buf, int length)
 {
-    return batCurrent;
+    char reg = (char)address;
+
+    stats.i2cTransactions += 2;
+    stats.i2cBytes += 1 + length;
+
+    if (busSelect) {
+        busSelect();
+    }
+    if (_i2c.write(I2CAddress << 1, &reg, 1) != 0 ||
+        _i2c.read(I2CAddress << 1, buf, length) != 0)
+    {
+        stats.i2cErrors++;
+        return false;
+    }
+    return true;
 }
 
 //----------------------------------------------------------------------------
+// checks the CRCs of raw data received during a burst read and copies the
+// registers with correct CRC to data (returns bit mask of these registers)
 
-int bq769x0::getBatteryVoltage()
+uint64_t bq769x0::decodeRegisters(const char *buf, uint8_t *data, int num)
 {
-    return batVoltage;
+    uint64_t valid = 0;
+
+    if (crcEnabled == true) {
+        for (int i = 0; i < num; i++) {
+            // CRC of first byte includes slave address (including R/W bit) and data,
+            // CRC of subsequent bytes contain only data
+            uint8_t crc = _crc8_ccitt_update(i == 0 ? crcAddressRead : 0, buf[i*2]);
+            if (crc == (uint8_t)buf[i*2 + 1]) {
+                data[i] = buf[i*2];
+                valid |= (uint64_t)1 << i;
+            }
+        }
+    }
+    else {
+        memcpy(data, buf, num);
+        valid = ((uint64_t)1 << num) - 1;
+    }
+    return valid;
 }
 
 //----------------------------------------------------------------------------
 
-int bq769x0::getMaxCellVoltage()
+uint64_t bq769x0::dumpRegisters(uint8_t data[NUM_DUMP_REGISTERS])
 {
-    return cellVoltages[idCellMaxVoltage];
+    uint64_t low = 0;
+    uint64_t high = 0;
+
+    memset(data, 0, NUM_DUMP_REGISTERS);
+    readRegisters(SYS_STAT, data, NUM_CACHED_REGISTERS, &low);
+    readRegisters(ADCGAIN1, &data[NUM_CACHED_REGISTERS], ADCGAIN2 - ADCGAIN1 + 1, &high);
+
+    return low | high << NUM_CACHED_REGISTERS;
 }
 
 //----------------------------------------------------------------------------
 
-int bq769x0::getMinCellVoltage()
+int bq769x0::getAdcGain()
 {
-    return cellVoltages[idCellMinVoltage];
+    return adcGain;
 }
 
 //----------------------------------------------------------------------------
 
-int bq769x0::getCellVoltage(int idCell)
+int bq769x0::getAdcOffset()
 {
-    return cellVoltages[idCell-1];
+    return adcOffset;
 }
 
 //----------------------------------------------------------------------------
+// limits the number and duration of attempts of one register access
 
-int bq769x0::getNumberOfCells(void)
+bool bq769x0::retryAllowed(int attempt, int start_us)
 {
-    return numberOfCells;
+    return attempt == 0 || (!probing && attempt <= maxRetries &&
+        _timer.read_us() - start_us < retryTimeout_us);
 }
 
 //----------------------------------------------------------------------------
+// called if the IC did not respond at all within the retry budget
 
-int bq769x0::getNumberOfConnectedCells(void)
+void bq769x0::busError()
 {
-    return connectedCells;
+    if (probing) {
+        return;     // no response expected
+    }
+    BQ769X0_TRACE(BQ769X0_TRACE_ERROR, TRACE_I2C_ERROR, I2CAddress);
+    recoverBus();
 }
 
 //----------------------------------------------------------------------------
 
-float bq769x0::getTemperatureDegC(int channel)
+void bq769x0::setRetryBudget(int retries, int timeout_us)
 {
-    if (channel >= 1 && channel <= 3) {
-        return (float)temperatures[channel-1] / 10.0;
-    }
-    else {
-        return -273.15;   // Error: Return absolute minimum temperature
-    }
+    maxRetries = retries;
+    retryTimeout_us = timeout_us;
 }
 
 //----------------------------------------------------------------------------
 
-float bq769x0::getTemperatureDegF(int channel)
+void bq769x0::setBusSelect(Callback<void()> select)
 {
-    return getTemperatureDegC(channel) * 1.8 + 32;
+    busSelect = select;
 }
 
-
 //----------------------------------------------------------------------------
+// pins of the I2C bus, needed to clock out a slave which holds SDA low after
+// an interrupted transfer
 
-void bq769x0::updateTemperatures()
+void bq769x0::setBusRecoveryPins(PinName sda, PinName scl)
 {
-    float tmp = 0;
-    int adcVal = 0;
-    int vtsx = 0;
-    unsigned long rts = 0;
-
-    // calculate R_thermistor according to bq769x0 datasheet
-    adcVal = (readRegister(TS1_HI_BYTE) & 0b00111111) << 8 | readRegister(TS1_LO_BYTE);
-    vtsx = adcVal * 0.382; // mV
-    rts = 10000.0 * vtsx / (3300.0 - vtsx); // Ohm
+    sdaPin = sda;
+    sclPin = scl;
+}
 
-    // Temperature calculation using Beta equation
-    // - According to bq769x0 datasheet, only 10k thermistors should be used
-    // - 25°C reference temperature for Beta equation assumed
-    tmp = 1.0/(1.0/(273.15+25) + 1.0/thermistorBetaValue*log(rts/10000.0)); // K
-    temperatures[0] = (tmp - 273.15) * 10.0;
+//----------------------------------------------------------------------------
+// toggles SCL up to 9 times until SDA is released, generates a STOP condition
+// and hands the pins back to the I2C peripheral (returns true if SDA is high)
 
-    if (type == bq76930 || type == bq76940) {
-        adcVal = (readRegister(TS2_HI_BYTE) & 0b00111111) << 8 | readRegister(TS2_LO_BYTE);
-        vtsx = adcVal * 0.382; // mV
-        rts = 10000.0 * vtsx / (3300.0 - vtsx); // Ohm
-        tmp = 1.0/(1.0/(273.15+25) + 1.0/thermistorBetaValue*log(rts/10000.0)); // K
-        temperatures[1] = (tmp - 273.15) * 10.0;
+bool bq769x0::recoverBus()
+{
+    if (sdaPin == NC || sclPin == NC) {
+        return false;
     }
 
-    if (type == bq76940) {
-        adcVal = (readRegister(TS3_HI_BYTE) & 0b00111111) << 8 | readRegister(TS3_LO_BYTE);
-        vtsx = adcVal * 0.382; // mV
-        rts = 10000.0 * vtsx / (3300.0 - vtsx); // Ohm
-        tmp = 1.0/(1.0/(273.15+25) + 1.0/thermistorBetaValue*log(rts/10000.0)); // K
-        temperatures[2] = (tmp - 273.15) * 10.0;
+    // open drain emulated by switching between input and output low
+    DigitalInOut sda(sdaPin);
+    DigitalInOut scl(sclPin);
+    sda.input();
+    scl.input();
+    sda = 0;
+    scl = 0;
+
+    for (int i = 0; i < 9 && sda.read() == 0; i++) {
+        scl.output();       // SCL low
+        wait_us(5);
+        scl.input();        // SCL high
+        wait_us(5);
     }
-}
 
+    // STOP condition: SDA rising while SCL is high
+    scl.output();
+    wait_us(5);
+    sda.output();
+    wait_us(5);
+    scl.input();
+    wait_us(5);
+    sda.input();
+    wait_us(5);
+
+    bool released = sda.read() == 1;
+
+    pinmap_pinout(sdaPin, i2c_master_sda_pinmap());
+    pinmap_pinout(sclPin, i2c_master_scl_pinmap());
+
+    stats.busRecoveries++;
+    BQ769X0_TRACE(BQ769X0_TRACE_WARNING, TRACE_BUS_RECOVERY, released);
+
+    return released;
+}
 
 //----------------------------------------------------------------------------
 
-void bq769x0::updateCurrent()
+bool bq769x0::isCacheValid(int address)
 {
-    int adcVal = 0;
-    regSYS_STAT_t sys_stat;
-    sys_stat.regByte = readRegister(SYS_STAT);
+    return (regCacheValid >> address) & 1;
+}
 
-    // check if new current reading available
-    if (sys_stat.bits.CC_READY == 1)
-    {
-        //printf("reading CC register...\n");
-        adcVal = (readRegister(CC_HI_BYTE) << 8) | readRegister(CC_LO_BYTE);
-        batCurrent = (int16_t) adcVal * 8.44 / shuntResistorValue_mOhm;  // mA
+//----------------------------------------------------------------------------
+// determines the register blocks to be read for the cache: SYS_STAT to CC_CFG,
+// populated cell voltages and BAT_HI_BYTE to CC_LO_BYTE, where registers of
+// unpopulated cells are only skipped if this saves a new burst read
 
-        coulombCounter += batCurrent / 4;  // is read every 250 ms
+void bq769x0::calculateCacheBlocks()
+{
+    bool needed[NUM_CACHED_REGISTERS];
+    int gap = 0;
 
-        // reduce resolution for actual current value
-        if (batCurrent > -10 && batCurrent < 10) {
-            batCurrent = 0;
+    for (int address = 0; address < NUM_CACHED_REGISTERS; address++) {
+        needed[address] = address < VC1_HI_BYTE || address >= BAT_HI_BYTE;
+    }
+    for (int i = 0; i < numberOfCells; i++) {
+        if (cellPopulationMask & (1 << i)) {
+            needed[VC1_HI_BYTE + i*2] = true;
+            needed[VC1_LO_BYTE + i*2] = true;
         }
+    }
 
-        // reset idleTimestamp
-        if (abs(batCurrent) > idleCurrentThreshold) {
-            idleTimestamp = _timer.read_ms();
+    numberOfCacheBlocks = 0;
+    for (int address = 0; address < NUM_CACHED_REGISTERS; address++)
+    {
+        if (needed[address] == false) {
+            gap++;
+            continue;
         }
 
-        // no error occured which caused alert
-        if (!(sys_stat.regByte & 0b00111111)) {
-            alertInterruptFlag = false;
+        // overhead of a new burst read is about the same as reading two
+        // registers (one cell) in between
+        if (numberOfCacheBlocks > 0 && gap <= 2) {
+            cacheBlocks[numberOfCacheBlocks - 1].length += gap + 1;
         }
-
-        writeRegister(SYS_STAT, 0b10000000);  // Clear CC ready flag
+        else {
+            cacheBlocks[numberOfCacheBlocks].address = address;
+            cacheBlocks[numberOfCacheBlocks].length = 1;
+            numberOfCacheBlocks++;
+        }
+        gap = 0;
     }
 }
 
 //----------------------------------------------------------------------------
-// reads all cell voltages to array cellVoltages[NUM_CELLS] and updates batVoltage
+// reads SYS_STAT to CC_LO_BYTE into the register cache, using one burst read
+// for bq76940 with all cells populated and more for other configurations
+// (returns false only if no register at all could be read, regCacheValid
+// marks the registers received correctly)
 
-void bq769x0::updateVoltages()
+bool bq769x0::updateRegisterCache()
 {
-    long adcVal = 0;
-    char buf[4];
-    int connectedCellsTemp = 0;
-
-    uint8_t crc;
+    regCacheValid = 0;
+    for (int i = 0; i < numberOfCacheBlocks; i++) {
+        uint64_t valid;
+        readRegisters(cacheBlocks[i].address, &regCache[cacheBlocks[i].address],
+            cacheBlocks[i].length, &valid);
+        regCacheValid |= valid << cacheBlocks[i].address;
+    }
+    return regCacheValid != 0;
+}
 
-    // read cell voltages
-    buf[0] = (char) VC1_HI_BYTE;
-    _i2c.write(I2CAddress << 1, buf, 1);;
+//----------------------------------------------------------------------------
+// evaluates the measurements of a register cache update (readings with
+// invalid registers keep their previous value)
 
-    idCellMaxVoltage = 0;
-    idCellMinVoltage = 0;
-    for (int i = 0; i < numberOfCells; i++)
-    {
-        if (crcEnabled == true) {
-            _i2c.read(I2CAddress << 1, buf, 4);
-            adcVal = (buf[0] & 0b00111111) << 8 | buf[2];
+void bq769x0::processRegisterCache()
+{
+    verifyShadowRegisters();
+    updateCurrent();  // will only use new current value if CC_READY is set
+    updateVoltages();
+    updateTemperatures();
+}
 
-            // CRC of first bytes includes slave address (including R/W bit) and data
-            crc = _crc8_ccitt_update(0, (I2CAddress << 1) | 1);
-            crc = _crc8_ccitt_update(crc, buf[0]);
-            if (crc != buf[1]) return; // don't save corrupted value
+#if DEVICE_I2C_ASYNCH
 
-            // CRC of subsequent bytes contain only data
-            crc = _crc8_ccitt_update(0, buf[2]);
-            if (crc != buf[3]) return; // don't save corrupted value
-        }
-        else {
-            _i2c.read(I2CAddress << 1, buf, 2);
-            adcVal = (buf[0] & 0b00111111) << 8 | buf[1];
-        }
+//----------------------------------------------------------------------------
+// starts reading all measurements in the background, readyCallback is called
+// from interrupt context as soon as processAsyncUpdate() should be called
+// (returns false if the previous asynchronous update was not finished yet)
 
-        cellVoltages[i] = adcVal * adcGain / 1000 + adcOffset;
+bool bq769x0::updateAsync(Callback<void()> readyCallback)
+{
+    if (asyncState != ASYNC_IDLE) {
+        return false;
+    }
 
-        if (cellVoltages[i] > 500) {
-            connectedCellsTemp++;
-        }
+    asyncReadyCallback = readyCallback;
+    asyncState = ASYNC_BUSY;
+    asyncBlock = 0;
 
-        if (cellVoltages[i] > cellVoltages[idCellMaxVoltage]) {
-            idCellMaxVoltage = i;
-        }
-        if (cellVoltages[i] < cellVoltages[idCellMinVoltage] && cellVoltages[i] > 500) {
-            idCellMinVoltage = i;
-        }
+    if (startAsyncTransfer() == false) {
+        asyncState = ASYNC_IDLE;
+        return false;
     }
-    connectedCells = connectedCellsTemp;
-    
-    // read battery pack voltage
-    adcVal = (readRegister(BAT_HI_BYTE) << 8) | readRegister(BAT_LO_BYTE);
-    batVoltage = 4.0 * adcGain * adcVal / 1000.0 + connectedCells * adcOffset;
+    return true;
 }
 
 //----------------------------------------------------------------------------
+// starts the interrupt/DMA driven burst read of the current cache block into
+// asyncBuf, at the position corresponding to the register address
 
-void bq769x0::writeRegister(int address, int data)
+bool bq769x0::startAsyncTransfer()
 {
-    uint8_t crc = 0;
-    char buf[3];
+    int bytesPerRegister = crcEnabled ? 2 : 1;
+    int address = cacheBlocks[asyncBlock].address;
+
+    asyncAddress = (char)address;
+    stats.i2cTransactions += 2;     // write and read with repeated start
+    stats.i2cBytes += 1 + cacheBlocks[asyncBlock].length * bytesPerRegister;
+    if (busSelect) {
+        busSelect();
+    }
+    return _i2c.transfer(I2CAddress << 1, &asyncAddress, 1,
+        &asyncBuf[address * bytesPerRegister], cacheBlocks[asyncBlock].length * bytesPerRegister,
+        callback(this, &bq769x0::asyncTransferDone), I2C_EVENT_ALL) == 0;
+}
 
-    buf[0] = (char) address;
-    buf[1] = data;
+//----------------------------------------------------------------------------
+// I2C transfer completion handler (called in interrupt context)
 
-    if (crcEnabled == true) {
-        // CRC is calculated over the slave address (including R/W bit), register address, and data.
-        crc = _crc8_ccitt_update(crc, (I2CAddress << 1) | 0);
-        crc = _crc8_ccitt_update(crc, buf[0]);
-        crc = _crc8_ccitt_update(crc, buf[1]);
-        buf[2] = crc;
-        _i2c.write(I2CAddress << 1, buf, 3);
+void bq769x0::asyncTransferDone(int event)
+{
+    if (event & (I2C_EVENT_ERROR | I2C_EVENT_ERROR_NO_SLAVE | I2C_EVENT_TRANSFER_EARLY_NACK)) {
+        asyncState = ASYNC_FAILED;
+    }
+    else if (asyncBlock + 1 < numberOfCacheBlocks) {
+        asyncBlock++;
+        if (startAsyncTransfer()) {
+            return;
+        }
+        asyncState = ASYNC_FAILED;
     }
     else {
-        _i2c.write(I2CAddress << 1, buf, 2);
+        asyncState = ASYNC_READY;
+    }
+
+    if (asyncReadyCallback) {
+        asyncReadyCallback();
     }
 }
 
 //----------------------------------------------------------------------------
+// evaluates the data of an asynchronous update (must be called from thread
+// context, returns false if no valid data was received or still busy)
 
-int bq769x0::readRegister(int address)
+bool bq769x0::processAsyncUpdate()
 {
-    uint8_t crc = 0;
-    char buf[2];
+    if (asyncState == ASYNC_BUSY || asyncState == ASYNC_IDLE) {
+        return false;
+    }
 
-    #if BQ769X0_DEBUG
-    //printf("Read register: 0x%x \n", address);
-    #endif
+    int bytesPerRegister = crcEnabled ? 2 : 1;
 
-    buf[0] = (char)address;
-    _i2c.write(I2CAddress << 1, buf, 1);;
+    // after a failure, all blocks before asyncBlock were received
+    int receivedBlocks = (asyncState == ASYNC_READY) ? numberOfCacheBlocks : asyncBlock;
 
-    if (crcEnabled == true) {
-        do {
-            _i2c.read(I2CAddress << 1, buf, 2);
-            // CRC is calculated over the slave address (including R/W bit) and data.
-            crc = _crc8_ccitt_update(crc, (I2CAddress << 1) | 1);
-            crc = _crc8_ccitt_update(crc, buf[0]);
-        } while (crc != buf[1]);
-        return buf[0];
-    }
-    else {
-        _i2c.read(I2CAddress << 1, buf, 1);
-        return buf[0];
+    regCacheValid = 0;
+    for (int i = 0; i < receivedBlocks; i++) {
+        int address = cacheBlocks[i].address;
+        uint64_t valid = decodeRegisters(&asyncBuf[address * bytesPerRegister],
+            &regCache[address], cacheBlocks[i].length);
+        if (valid != ((uint64_t)1 << cacheBlocks[i].length) - 1) {
+            stats.crcErrorsBurst++;
+            BQ769X0_TRACE(BQ769X0_TRACE_WARNING, TRACE_CRC_ERROR, address);
+        }
+        regCacheValid |= valid << address;
     }
+    asyncState = ASYNC_IDLE;
+
+    processRegisterCache();
+    finishUpdate();
+    return regCacheValid != 0;
 }
 
+#endif // DEVICE_I2C_ASYNCH
+
 //----------------------------------------------------------------------------
 // The bq769x0 drives the ALERT pin high if the SYS_STAT register contains
 // a new value (either new CC reading or an error)
 
 void bq769x0::setAlertInterruptFlag()
 {
-    interruptTimestamp = _timer.read_ms();
     alertInterruptFlag = true;
+
+    if (alertHandler) {
+        alertHandler();
+    }
+}
+
+//----------------------------------------------------------------------------
+
+void bq769x0::attachAlertHandler(Callback<void()> handler)
+{
+    alertHandler = handler;
 }
 
 #if BQ769X0_DEBUG
 
 //----------------------------------------------------------------------------
-// for debug purposes
+// for debug purposes, based on the same burst reads as the diagnostics dump
+
+static const struct {
+    uint8_t index;      // in dumpRegisters() data
+    const char *name;
+} printedRegisters[] = {
+    { SYS_STAT, "SYS_STAT" },
+    { CELLBAL1, "CELLBAL1" },
+    { CELLBAL2, "CELLBAL2" },
+    { CELLBAL3, "CELLBAL3" },
+    { SYS_CTRL1, "SYS_CTRL1" },
+    { SYS_CTRL2, "SYS_CTRL2" },
+    { PROTECT1, "PROTECT1" },
+    { PROTECT2, "PROTECT2" },
+    { PROTECT3, "PROTECT3" },
+    { OV_TRIP, "OV_TRIP" },
+    { UV_TRIP, "UV_TRIP" },
+    { CC_CFG, "CC_CFG" },
+    { CC_HI_BYTE, "CC_HI" },
+    { CC_LO_BYTE, "CC_LO" },
+    { NUM_CACHED_REGISTERS + ADCGAIN1 - ADCGAIN1, "ADCGAIN1" },
+    { NUM_CACHED_REGISTERS + ADCOFFSET - ADCGAIN1, "ADCOFFSET" },
+    { NUM_CACHED_REGISTERS + ADCGAIN2 - ADCGAIN1, "ADCGAIN2" },
+};
 
 void bq769x0::printRegisters()
 {
-    printf("0x00 SYS_STAT:  %s\n", byte2char(readRegister(SYS_STAT)));
-    printf("0x01 CELLBAL1:  %s\n", byte2char(readRegister(CELLBAL1)));
-    printf("0x04 SYS_CTRL1: %s\n", byte2char(readRegister(SYS_CTRL1)));
-    printf("0x05 SYS_CTRL2: %s\n", byte2char(readRegister(SYS_CTRL2)));
-    printf("0x06 PROTECT1:  %s\n", byte2char(readRegister(PROTECT1)));
-    printf("0x07 PROTECT2:  %s\n", byte2char(readRegister(PROTECT2)));
-    printf("0x08 PROTECT3:  %s\n", byte2char(readRegister(PROTECT3)));
-    printf("0x09 OV_TRIP:   %s\n", byte2char(readRegister(OV_TRIP)));
-    printf("0x0A UV_TRIP:   %s\n", byte2char(readRegister(UV_TRIP)));
-    printf("0x0B CC_CFG:    %s\n", byte2char(readRegister(CC_CFG)));
-    printf("0x32 CC_HI:     %s\n", byte2char(readRegister(CC_HI_BYTE)));
-    printf("0x33 CC_LO:     %s\n", byte2char(readRegister(CC_LO_BYTE)));
-    /*
-    printf("0x50 ADCGAIN1:  %s\n", byte2char(readRegister(ADCGAIN1)));
-    printf("0x51 ADCOFFSET: %s\n", byte2char(readRegister(ADCOFFSET)));
-    printf("0x59 ADCGAIN2:  %s\n", byte2char(readRegister(ADCGAIN2)));
-    */
+    uint8_t data[NUM_DUMP_REGISTERS];
+    uint64_t valid = dumpRegisters(data);
+
+    for (unsigned int i = 0; i < sizeof(printedRegisters)/sizeof(printedRegisters[0]); i++) {
+        int index = printedRegisters[i].index;
+        int address = (index < NUM_CACHED_REGISTERS) ? index : index - NUM_CACHED_REGISTERS + ADCGAIN1;
+        char bits[9];
+        for (int bit = 0; bit < 8; bit++) {
+            bits[bit] = (data[index] & (0x80 >> bit)) ? '1' : '0';
+        }
+        bits[8] = '\0';
+        printf("0x%02X %-10s %s\n", address, printedRegisters[i].name,
+            (valid & ((uint64_t)1 << index)) ? bits : "--------");
+    }
 }
 
 #endif
@@ -19,28 +19,254 @@
 
 #include "mbed.h"
 
-#define MAX_NUMBER_OF_CELLS 15
-#define MAX_NUMBER_OF_THERMISTORS 3
 #define NUM_OCV_POINTS 21
+#define NUM_THERMISTOR_TABLE_POINTS 129   // 14-bit TS ADC range in steps of 128 LSB
+#define NUM_CACHED_REGISTERS 0x34   // SYS_STAT (0x00) to CC_LO_BYTE (0x33)
+#define NUM_SHADOW_REGISTERS 0x0C   // CELLBAL1 (0x01) to CC_CFG (0x0B), index 0 unused
+#define READING_AGE_UNKNOWN 0xFFFF
+#define NUM_FAULTS 9                // SYS_STAT bits 0-5 and software protection
+#define BQ769X0_ERR_OCC 0x100       // software charge overcurrent (in errorStatus)
+#define NUM_DUMP_REGISTERS (NUM_CACHED_REGISTERS + 10)  // and ADCGAIN1 (0x50) to ADCGAIN2 (0x59)
 
 // IC type/size
 #define bq76920 1
 #define bq76930 2
 #define bq76940 3
 
-// output information to serial console for debugging
+// IC variant fixed at compile time (e.g. -DBQ769X0_VARIANT=bq76920): all
+// arrays are sized for this IC only and the numbers of cells and thermistors
+// become constants, so that the loops over them can be unrolled. With 0, the
+// type passed to the constructor is used and arrays are sized for bq76940.
+#ifndef BQ769X0_VARIANT
+#define BQ769X0_VARIANT 0
+#endif
+
+#if BQ769X0_VARIANT == bq76920
+#define MAX_NUMBER_OF_CELLS 5
+#elif BQ769X0_VARIANT == bq76930
+#define MAX_NUMBER_OF_CELLS 10
+#else
+#define MAX_NUMBER_OF_CELLS 15
+#endif
+#define MAX_NUMBER_OF_THERMISTORS (MAX_NUMBER_OF_CELLS / 5)
+
+// output information to serial console for debugging (see also bq769x0Trace.h)
+#ifndef BQ769X0_DEBUG
 #define BQ769X0_DEBUG 1
+#endif
+
+// CRC-8 implementations
+#define BQ769X0_CRC_BITWISE 0   // smallest code size, slowest
+#define BQ769X0_CRC_NIBBLE  1   // 16 byte table
+#define BQ769X0_CRC_TABLE   2   // 256 byte table
+#define BQ769X0_CRC_STM32   3   // STM32 hardware CRC unit
+
+#ifndef BQ769X0_CRC_IMPL
+#define BQ769X0_CRC_IMPL BQ769X0_CRC_TABLE
+#endif
+
+// maps for settings in protection registers (RSNS = 1)
+
+constexpr int SCD_delay_setting [4] =
+  { 70, 100, 200, 400 }; // us
+constexpr int SCD_threshold_setting [8] =
+  { 44, 67, 89, 111, 133, 155, 178, 200 }; // mV
+
+constexpr int OCD_delay_setting [8] =
+  { 8, 20, 40, 80, 160, 320, 640, 1280 }; // ms
+constexpr int OCD_threshold_setting [16] =
+  { 17, 22, 28, 33, 39, 44, 50, 56, 61, 67, 72, 78, 83, 89, 94, 100 };  // mV
+
+constexpr int UV_delay_setting [4] = { 1, 4, 8, 16 };  // s
+constexpr int OV_delay_setting [4] = { 1, 2, 4, 8 };   // s
+
+// index of the largest setting not above value (0 if value is below all settings)
+constexpr int protectionSetting(const int *settings, int index, long value)
+{
+    return (index == 0 || value >= settings[index]) ? index :
+        protectionSetting(settings, index - 1, value);
+}
+
+template <int N>
+constexpr int protectionSetting(const int (&settings)[N], long value)
+{
+    return protectionSetting(settings, N - 1, value);
+}
+
+// complete battery protection configuration, applied at once with
+// bq769x0::applyProtectionProfile()
+struct ProtectionProfile {
+    long shortCircuitCurrent_mA;
+    int shortCircuitDelay_us;
+    long dischargeCurrent_mA;           // OCD (hardware)
+    int dischargeCurrentDelay_ms;
+    long chargeCurrent_mA;              // OCC (software), 0 = disabled
+    int chargeCurrentDelay_ms;
+    int cellUndervoltage_mV;
+    int cellUndervoltageDelay_s;
+    int cellOvervoltage_mV;
+    int cellOvervoltageDelay_s;
+    int minDischargeTemp_degC;
+    int maxDischargeTemp_degC;
+    int minChargeTemp_degC;
+    int maxChargeTemp_degC;
+    int tempHysteresis_degC;
+    int balancingIdleTime_min;
+    int balancingMinVoltage_mV;
+    int balancingMaxVoltageDifference_mV;
+};
+
+// PROTECT1 to PROTECT3 register values of a profile. They can be resolved at
+// compile time if the shunt is known, e.g.
+//
+//   constexpr ProtectionProfile profile = { 100000, 200, 40000, 320, ... };
+//   constexpr ProtectionRegisters registers = resolveProtectionRegisters(profile, 1.0);
+//
+// OV_TRIP and UV_TRIP depend on the ADC calibration of the IC and are
+// calculated when the profile is applied.
+struct ProtectionRegisters {
+    uint8_t protect1;
+    uint8_t protect2;
+    uint8_t protect3;
+};
+
+constexpr uint8_t protect1Register(long current_mA, int delay_us, float shunt_mOhm)
+{
+    return 0x80 |   // RSNS = 1
+        protectionSetting(SCD_delay_setting, delay_us) << 3 |
+        protectionSetting(SCD_threshold_setting, (long)(current_mA * shunt_mOhm / 1000));
+}
+
+constexpr uint8_t protect2Register(long current_mA, int delay_ms, float shunt_mOhm)
+{
+    return protectionSetting(OCD_delay_setting, delay_ms) << 4 |
+        protectionSetting(OCD_threshold_setting, (long)(current_mA * shunt_mOhm / 1000));
+}
+
+constexpr uint8_t protect3Register(int uvDelay_s, int ovDelay_s)
+{
+    return protectionSetting(UV_delay_setting, uvDelay_s) << 6 |
+        protectionSetting(OV_delay_setting, ovDelay_s) << 4;
+}
+
+constexpr ProtectionRegisters resolveProtectionRegisters(const ProtectionProfile& profile, float shunt_mOhm)
+{
+    return ProtectionRegisters {
+        protect1Register(profile.shortCircuitCurrent_mA, profile.shortCircuitDelay_us, shunt_mOhm),
+        protect2Register(profile.dischargeCurrent_mA, profile.dischargeCurrentDelay_ms, shunt_mOhm),
+        protect3Register(profile.cellUndervoltageDelay_s, profile.cellOvervoltageDelay_s)
+    };
+}
+
+#define DERATING_CURVE_POINTS 33
+
+// derating factor vs. a measured value (°C/10, mV or SOC in 0.1 %) as
+// piecewise-linear table on a grid with 2^shift spacing, so that it can be
+// evaluated without search or division
+struct DeratingCurve {
+    int origin;                                 // value of first grid point
+    int shift;                                  // log2 of grid spacing
+    uint16_t factor[DERATING_CURVE_POINTS];     // 1024 = no derating
+};
+
+// consistent copy of the battery state, published after each update
+struct BatterySnapshot {
+    uint32_t sequence;                              // incremented with each update
+    unsigned long timestamp;                        // ms
+    int cellVoltages[MAX_NUMBER_OF_CELLS];          // mV
+    int idCellMaxVoltage;
+    int idCellMinVoltage;
+    int connectedCells;
+    long batVoltage;                                // mV
+    long batCurrent;                                // mA
+    int temperatures[MAX_NUMBER_OF_THERMISTORS];    // °C/10
+    int64_t coulombCounter;                         // mAs
+    int sysStat;                                    // last SYS_STAT register value
+    int errorStatus;
+    unsigned int balancingStatus;
+    int numberOfCells;                              // cells of IC
+    int numberOfThermistors;
+
+    // validity of the readings: bit masks of the values received in the last
+    // update and time since the last valid reading (ms, READING_AGE_UNKNOWN
+    // if older or never received)
+    unsigned int cellVoltagesValid;
+    unsigned int temperaturesValid;
+    uint16_t cellVoltageAge[MAX_NUMBER_OF_CELLS];
+    uint16_t temperatureAge[MAX_NUMBER_OF_THERMISTORS];
+    uint16_t batVoltageAge;
+    uint16_t batCurrentAge;
+
+    long chargeCurrentLimit;                        // mA, derated (see setCurrentLimits)
+    long dischargeCurrentLimit;                     // mA, positive value
+};
+
+#define NUM_TIMING_HISTOGRAM_BINS 8  // < 0.5, 1, 2, 4, 8, 16, 32 ms and above
+
+struct TimingStats {
+    uint32_t count;
+    uint32_t max_us;
+    uint32_t avg_us;
+    uint32_t histogram[NUM_TIMING_HISTOGRAM_BINS];
+};
+
+// index of DriverStats::faultCounts (SYS_STAT bits 0-5 first)
+enum FaultCounter {
+    FAULT_COUNT_OCD,
+    FAULT_COUNT_SCD,
+    FAULT_COUNT_OV,
+    FAULT_COUNT_UV,
+    FAULT_COUNT_OVRD_ALERT,
+    FAULT_COUNT_DEVICE_XREADY,
+    FAULT_COUNT_OCC,            // software charge overcurrent
+    FAULT_COUNT_TEMP_CHG,       // cell temperature outside of charge limits
+    FAULT_COUNT_TEMP_DSG,
+    NUM_FAULT_COUNTERS
+};
+
+// counters to determine bus load and timing of the driver
+struct DriverStats {
+    uint32_t i2cTransactions;
+    uint32_t i2cBytes;                  // without slave address bytes
+    uint32_t crcErrorsSingle;           // single register reads
+    uint32_t crcErrorsBurst;            // burst reads (measurements)
+    uint32_t i2cErrors;                 // transfers not acknowledged
+    uint32_t busRecoveries;
+    uint32_t transactionsLastUpdate;    // I2C transactions of last update()
+    uint32_t transactionsMaxUpdate;
+    unsigned long missedCCReadings;
+    TimingStats update;
+    TimingStats checkStatus;            // only calls which accessed the IC
+    uint32_t faultCounts[NUM_FAULT_COUNTERS];   // occurrences of each fault
+};
+
+class bq769x0Log;
+class bq769x0Soc;
+class bq769x0CellStats;
 
 class bq769x0 {
 
+    friend class bq769x0Stack;
+
 public:
 
     // initialization, status update and shutdown
+    //
+    // The given address and CRC setting (e.g. persisted from getI2CAddress()
+    // and isCrcEnabled() of a previous start) is verified first, the other
+    // combinations are only probed if the IC does not respond.
     bq769x0(I2C& bqI2C, PinName alertPin, int bqType = bq76930, int bqI2CAddress = 0x08, bool crc = true);
     int checkStatus();  // returns 0 if everything is OK
     void update(void);
-    void boot(PinName bootPin);
+#if DEVICE_I2C_ASYNCH
+    // non-blocking alternative to update()
+    bool updateAsync(Callback<void()> readyCallback);
+    bool processAsyncUpdate(void);
+#endif
+    bool boot(PinName bootPin);     // returns false if IC did not respond
     void shutdown(void);
+    int getI2CAddress(void);
+    bool isCrcEnabled(void);
 
     // charging control
     bool enableCharging(void);
@@ -54,11 +280,44 @@ public:
 
     void resetSOC(int percent = -1);    // 0-100 %, -1 for automatic reset based on OCV
     void setBatteryCapacity(long capacity_mAh);
-    void setOCV(int voltageVsSOC[NUM_OCV_POINTS]);
+    void setOCV(const int voltageVsSOC[NUM_OCV_POINTS]);   // values are copied
+
+    // coulomb counter calibration and diagnostics
+    void calibrateCurrentOffset(void);  // call with zero current
+    void setCurrentOffset(int offset_LSB);
+    int getCurrentOffset(void);
+    unsigned long getMissedCCReadings(void);
+    DriverStats getStats(void);
+    void resetStats(void);
+
+    // register map and calibration for diagnostics (see bq769x0Diag): burst
+    // reads of 0x00 to 0x33 and 0x50 to 0x59 into data, returns bit mask of
+    // the bytes received correctly
+    uint64_t dumpRegisters(uint8_t data[NUM_DUMP_REGISTERS]);
+    int getAdcGain(void);       // uV/LSB
+    int getAdcOffset(void);     // mV
+
+    // I2C error handling: retries for NACK or wrong CRC within a time limit
+    // per register access and bus recovery if the IC does not respond at all
+    void setRetryBudget(int retries, int timeout_us);
+    void setBusRecoveryPins(PinName sda, PinName scl);
+    bool recoverBus(void);
+
+    // called before each bus transfer, e.g. to switch the channel of an I2C
+    // mux shared by several ICs (see bq769x0Stack), so that also checkStatus()
+    // after an alert and the FET and protection settings access the right IC
+    // (the channel has to be selected manually before calling the constructor)
+    void setBusSelect(Callback<void()> select);
 
     int getNumberOfCells(void);
     int getNumberOfConnectedCells(void);
 
+    // cells physically connected to IC (e.g. 13S pack with bq76940)
+    void setCellPopulationMask(unsigned int mask);
+    unsigned int learnCellPopulation(void);
+    unsigned int getCellPopulationMask(void);
+    int getNumberOfPopulatedCells(void);
+
     // limit settings (for battery protection)
     void setTemperatureLimits(int minDischarge_degC, int maxDischarge_degC, int minCharge_degC, int maxCharge_degC, int hysteresis_degC = 2);    // °C
     long setShortCircuitProtection(long current_mA, int delay_us = 70);
@@ -67,18 +326,55 @@ public:
     int setCellUndervoltageProtection(int voltage_mV, int delay_s = 1);
     int setCellOvervoltageProtection(int voltage_mV, int delay_s = 1);
 
+    // all of the above and balancing thresholds with a single block write of
+    // PROTECT1 to UV_TRIP, verified by reading back (returns false on mismatch,
+    // the registers are corrected later by the verification of the updates)
+    bool applyProtectionProfile(const ProtectionProfile& profile);
+    bool applyProtectionProfile(const ProtectionProfile& profile, const ProtectionRegisters& registers);
+
+    // maximum currents for the charger/inverter (discharge current as positive
+    // value), derated after each update depending on temperature, cell voltage
+    // headroom, SOC and estimated cell resistance (if available)
+    void setCurrentLimits(long maxCharge_mA, long maxDischarge_mA);
+    long getChargeCurrentLimit(void);
+    long getDischargeCurrentLimit(void);
+
     // balancing settings
     void setBalancingThresholds(int idleTime_min = 30, int absVoltage_mV = 3400, int voltageDifference_mV = 20);
+    // balancing is suspended every interval_s for the settle time plus one ADC
+    // conversion period (250 ms) to measure unbiased cell voltages
+    void setBalancingMeasurementWindow(int interval_s = 30, int settleTime_ms = 100);
+    float getBalancingDutyCycle(void);
     void setIdleCurrentThreshold(int current_mA);
 
     // automatic balancing when battery is within balancing thresholds
     void enableAutoBalancing(void);
     void disableAutoBalancing(void);
 
+    // low-power mode: if the battery is idle (see setIdleCurrentThreshold)
+    // for idleTime_s, the CC is switched to one-shot mode and voltages and
+    // temperatures are only sampled every interval_s with the ADC switched
+    // off in between (also disables OV protection of the IC). update() does
+    // not access the bus between the samples. Full rate is resumed on faults,
+    // current above the idle threshold or balancing. Only supported with
+    // update(), not with updateAsync() or bq769x0Stack.
+    void enableLowPowerMode(int interval_s = 10, int idleTime_s = 60);
+    void disableLowPowerMode(void);
+    bool isLowPowerActive(void);
+
+    // cell resistance estimation: after a current step of at least
+    // stepThreshold_mA (0 disables) the cell voltages are read directly after
+    // the first settled CC reading and compared to the voltages before the
+    // step. dV/dI is tracked per cell with recursive least squares, older
+    // steps are weighted with forgettingFactor^n.
+    void setResistanceEstimation(int stepThreshold_mA, float forgettingFactor = 0.95f);
+    float getCellResistance(int idCell);    // mOhm, 0 if not estimated yet
+    int getResistanceSamples(void);         // number of evaluated steps
+
     // battery status
     int  getBatteryCurrent(void);
     int  getBatteryVoltage(void);
-    int  getCellVoltage(int idCell);    // from 1 to 15
+    int  getCellVoltage(int idCell);    // from 1 to number of populated cells
     int  getMinCellVoltage(void);
     int  getMaxCellVoltage(void);
     int  getAvgCellVoltage(void);
@@ -87,9 +383,27 @@ public:
     float getSOC(void);
     int getBalancingStatus(void);
 
+    // copy of the state after the last update, can be called from any thread
+    BatterySnapshot getSnapshot(void);
+
+    // binary log of the state after each update
+    void attachLog(bq769x0Log *log);
+
+    // model-based SOC estimation, updated after each update (also used by
+    // resetSOC(-1) instead of the OCV points once initialized, resetSOC with
+    // a known percentage resets the estimator)
+    void attachSocEstimator(bq769x0Soc *estimator);
+
+    // per-cell statistics, updated with each unbiased voltage reading (the
+    // filtered voltages are used for balancing decisions if attached)
+    void attachCellStats(bq769x0CellStats *stats);
+
     // interrupt handling (not to be called manually!)
     void setAlertInterruptFlag(void);
 
+    // additional handler called in interrupt context on rising edge of ALERT pin
+    void attachAlertHandler(Callback<void()> handler);
+
     #if BQ769X0_DEBUG
     void printRegisters(void);
     #endif
@@ -101,33 +415,84 @@ private:
     I2C& _i2c;
     Timer _timer;
     InterruptIn _alertInterrupt;
+    Timeout _faultTimeout;
 
     int I2CAddress;
+#if BQ769X0_VARIANT
+    static const int type = BQ769X0_VARIANT;
+#else
     int type;
+#endif
     bool crcEnabled;
+    uint8_t crcAddressWrite;    // CRC of address byte incl. R/W bit
+    uint8_t crcAddressRead;
 
     float shuntResistorValue_mOhm;
     int thermistorBetaValue;  // typical value for Semitec 103AT-5 thermistor: 3435
-    int *OCV;  // Open Circuit Voltage of cell for SOC 100%, 95%, ..., 5%, 0%
+    int16_t thermistorTable[NUM_THERMISTOR_TABLE_POINTS];    // °C/10 vs. TS ADC value
+    int OCV[NUM_OCV_POINTS];  // Open Circuit Voltage of cell for SOC 100%, 95%, ..., 5%, 0% (mV)
 
     // indicates if a new current reading or an error is available from BMS IC
     bool alertInterruptFlag;
+    Callback<void()> alertHandler;
+    Callback<void()> busSelect;
 
+#if BQ769X0_VARIANT
+    static const int numberOfCells = MAX_NUMBER_OF_CELLS;
+#else
     int numberOfCells;                      // number of cells allowed by IC
+#endif
     int connectedCells;                     // actual number of cells connected
-    int cellVoltages[MAX_NUMBER_OF_CELLS];          // mV
+    unsigned int cellPopulationMask;        // bit n set if cell n+1 is populated
+    int numberOfPopulatedCells;
+    int cellMap[MAX_NUMBER_OF_CELLS];       // populated cell index vs. IC cell index
+    int cellVoltages[MAX_NUMBER_OF_CELLS];          // mV, indexed like IC cells
     int idCellMaxVoltage;
     int idCellMinVoltage;
+    int avgCellVoltage;                             // mV
     long batVoltage;                                // mV
     long batCurrent;                                // mA
     int temperatures[MAX_NUMBER_OF_THERMISTORS];    // °C/10
 
-    long nominalCapacity;    // mAs, nominal capacity of battery pack, max. 1193 Ah possible
-    long coulombCounter;     // mAs (= milli Coulombs) for current integration
+    // time of last valid reading (ms) and readings received in last update
+    unsigned long cellVoltageTimestamp[MAX_NUMBER_OF_CELLS];
+    unsigned long temperatureTimestamp[MAX_NUMBER_OF_THERMISTORS];
+    unsigned long batVoltageTimestamp;
+    unsigned int cellVoltagesValid;
+    unsigned int temperaturesValid;
+    unsigned int temperaturesReceived;  // channels with at least one reading
+
+    int64_t nominalCapacity; // mAs, nominal capacity of battery pack
+    int64_t coulombCounter;  // mAs (= milli Coulombs) for current integration
+    int64_t ccAccumulator;   // CC LSB * ms, integrated raw readings without offset
+    int ccOffset;            // CC LSB, reading at zero current
+    int ccRaw;               // CC LSB, last reading
+    unsigned long ccTimestamp;  // ms, time of last CC reading
+    bool ccTimestampValid;
+    unsigned long missedCCReadings;
+
+    DriverStats stats;
+    uint64_t updateTimeSum_us;
+    uint64_t checkStatusTimeSum_us;
+
+    // I2C error handling
+    int maxRetries;
+    int retryTimeout_us;
+    bool probing;               // single attempts without bus error handling
+    PinName sdaPin;
+    PinName sclPin;
 
     // Current limits (mA)
     long maxChargeCurrent;
     long maxDischargeCurrent;
+    long chargeCurrentLimit;        // derated values of last update
+    long dischargeCurrentLimit;
+    DeratingCurve chargeTempDerating;
+    DeratingCurve dischargeTempDerating;
+    DeratingCurve chargeVoltageDerating;    // vs. max. cell voltage
+    DeratingCurve dischargeVoltageDerating; // vs. min. cell voltage
+    DeratingCurve chargeSocDerating;
+    DeratingCurve dischargeSocDerating;
     int idleCurrentThreshold; // mA
 
     // Temperature limits (°C/10)
@@ -143,35 +508,193 @@ private:
     int balancingMinCellVoltage_mV;
     int balancingMaxVoltageDifference_mV;
 
+    // copy of the registers SYS_STAT to CC_LO_BYTE, updated by burst reads
+    uint8_t regCache[NUM_CACHED_REGISTERS];
+    uint64_t regCacheValid;     // bit n set if regCache[n] was received correctly
+
+    // last values written to the control registers CELLBAL1 to CC_CFG
+    uint8_t regShadow[NUM_SHADOW_REGISTERS];
+    uint16_t regShadowValid;    // bit n set if regShadow[n] is known
+
+    // register blocks read with one burst each to update the cache
+    struct RegisterBlock {
+        uint8_t address;
+        uint8_t length;
+    };
+    RegisterBlock cacheBlocks[MAX_NUMBER_OF_CELLS / 2 + 2];
+    int numberOfCacheBlocks;
+
+#if DEVICE_I2C_ASYNCH
+    enum AsyncState {
+        ASYNC_IDLE,
+        ASYNC_BUSY,             // reading cacheBlocks[asyncBlock]
+        ASYNC_READY,            // waiting for processAsyncUpdate()
+        ASYNC_FAILED
+    };
+    volatile AsyncState asyncState;
+    int asyncBlock;
+    Callback<void()> asyncReadyCallback;
+    char asyncAddress;
+    char asyncBuf[NUM_CACHED_REGISTERS * 2];    // raw data incl. CRC bytes
+#endif
+
     int adcGain;    // uV/LSB
     int adcOffset;  // mV
 
+    // pre-calculated fixed-point scaling factors for integer-only conversion
+    int32_t currentScale;       // mA/LSB of CC, 16 fractional bits
+    int32_t cellVoltageScale;   // mV/LSB of VCx, 16 fractional bits
+    int32_t batVoltageScale;    // mV/LSB of BAT, 14 fractional bits
+
     int errorStatus;
     bool autoBalancingEnabled;
     unsigned int balancingStatus;     // holds on/off status of balancing switches
+    int balancingReferenceVoltage;    // mV, lowest cell voltage of pack (0: own min. voltage)
+    int balancingVoltages[MAX_NUMBER_OF_CELLS];  // mV, at last evaluation of balanced cells
+    unsigned int balancingLowPriority;  // cells balanced in previous phase
+    unsigned long balancingPhaseStart;  // ms
+
+    // measurement windows
+    unsigned int balancingSuspended;    // cells to be balanced after window
+    int balancingMeasurementInterval_ms;
+    int balancingSettleTime_ms;
+    unsigned long balancingMeasurementTimestamp;
+    unsigned long balancingWindowStart;
+    unsigned long balancingTimestamp;   // last call of updateBalancingSwitches
+    uint64_t balancingOnTime_ms;
+    uint64_t balancingSuspendedTime_ms;
     int balancingMinIdleTime_s;
     unsigned long idleTimestamp;
 
-    unsigned int secSinceErrorCounter;
-    unsigned long interruptTimestamp;
-
-    bool cellTempChargeErrorFlag;
+    // low-power mode
+    enum PowerState {
+        POWER_NORMAL,
+        POWER_LOW_IDLE,         // ADC off, waiting for next sample
+        POWER_LOW_SAMPLING      // ADC on and CC one-shot triggered
+    };
+    PowerState powerState;
+    bool lowPowerEnabled;
+    int lowPowerInterval_ms;
+    int lowPowerIdleTime_ms;
+    unsigned long powerStateTimestamp;
+
+    // cell resistance estimation
+    enum ResistanceState {
+        RESISTANCE_IDLE,
+        RESISTANCE_STEP,        // step detected, waiting for settled CC reading
+        RESISTANCE_MEASURE      // current settled, voltages to be read
+    };
+    ResistanceState resistanceState;
+    int resistanceStepThreshold;        // mA, 0 = disabled
+    float resistanceForgetting;
+    long resistanceRefCurrent;          // mA, current of reference voltages
+    int resistanceRefVoltages[MAX_NUMBER_OF_CELLS];  // mV, last readings before step
+    bool resistanceRefValid;
+    float cellResistance[MAX_NUMBER_OF_CELLS];       // mOhm, indexed like IC cells
+    float cellResistanceCovariance[MAX_NUMBER_OF_CELLS];
+    int resistanceSamples;
+
+    // fault recovery
+    enum FaultState {
+        FAULT_NONE,
+        FAULT_WAITING,          // until faultRetryTime
+        FAULT_CLEARING          // flag reset, waiting for SYS_STAT confirmation
+    };
+    FaultState faultStates[NUM_FAULTS];         // index = bit in errorStatus
+    unsigned long faultRetryTime[NUM_FAULTS];   // ms
+    unsigned long nextFaultRetry;               // ms, earliest of faultRetryTime
+    bool faultRetryPending;
+    bool handlingFaults;
+    int softwareErrors;         // BQ769X0_ERR_xxx flags
+    int fetRecoveryPending;     // CHG (bit 0) and DSG (bit 1) to be enabled after all faults are cleared
+
+    // software charge overcurrent protection
+    long occThreshold_mA;       // 0 = disabled
+    int occDelayPeriods;        // CC periods
+    int occPeriods;             // consecutive CC periods above threshold
+
+    // temperature protection: min/max of all thermistors and verdict with
+    // hysteresis, evaluated once per updateTemperatures()
+    int minTemperature;             // °C/10
+    int maxTemperature;             // °C/10
+    bool cellTempChargeError;
+    bool cellTempDischargeError;
+    bool cellTempChargeErrorFlag;   // verdict applied to the FETs by checkCellTemp()
     bool cellTempDischargeErrorFlag;
 
+    // double buffer for snapshots, the active one is snapshots[snapshotSequence & 1]
+    BatterySnapshot snapshots[2];
+    volatile uint32_t snapshotSequence;
+
+    bq769x0Log *telemetryLog;
+    bq769x0Soc *socEstimator;
+    bq769x0CellStats *cellStats;
+
     // Methods
 
-    bool determineAddressAndCrc(void);
+    bool determineAddressAndCrc(int address, bool crc);
+    bool verifyAddressAndCrc(int address, bool crc);
+    void setAddressAndCrc(int address, bool crc);
+    void initialize(void);
+
+    void calculateCacheBlocks(void);
+    bool updateRegisterCache(void);
+    void processRegisterCache(void);
+    void verifyShadowRegisters(void);
 
     void  updateVoltages(void);
     void  updateCurrent(void);
+    void  checkOvercurrentCharge(int periods);
+    void  setCoulombCounter(int64_t charge_mAs);
+    void  readCellVoltages(void);
+    void  detectCurrentStep(int periods);
+    void  updateCellResistance(void);
     void  updateTemperatures(void);
+    void  calculateThermistorTable(void);
 
     void updateBalancingSwitches(void);
+    unsigned int calculateBalancingMask(int minVoltage);
+    void writeBalancingSwitches(unsigned int mask);
+    bool balancingVoltagesChanged(void);
+    bool balancingVoltagesBiased(unsigned long now);
+    bool balancingWindowSettled(unsigned long now);
+    int balancingCellVoltage(int idCell);
+
+    void calculateDeratingCurves(void);
+    void updateCurrentLimits(void);
 
+    void checkTemperatureLimits(void);
     void checkCellTemp(void);
+    void handleFaults(int sysStat);
+    void scheduleFaultRetry(void);
+    void recoverFets(void);
+    void faultRetryDue(void);
+
+    void finishUpdate(void);
+    bool updatePowerState(void);
+    void enterLowPower(void);
+    void exitLowPower(void);
+    void publishSnapshot(void);
+    void recordTiming(TimingStats& timing, uint64_t& sum_us, int start_us);
 
     int  readRegister(int address);
-    void writeRegister(int address, int data);
+    bool readRegisters(int address, uint8_t *data, int num, uint64_t *valid = NULL);
+    bool readRaw(int address, char *buf, int length);
+    uint64_t decodeRegisters(const char *buf, uint8_t *data, int num);
+    bool isCacheValid(int address);
+    bool retryAllowed(int attempt, int start_us);
+    void busError(void);
+
+#if DEVICE_I2C_ASYNCH
+    bool startAsyncTransfer(void);
+    void asyncTransferDone(int event);
+#endif
+    bool writeRegister(int address, int data);
+    bool writeRegisters(int address, const uint8_t *data, int num);
+    int ovTripRegister(int voltage_mV);
+    int uvTripRegister(int voltage_mV);
+    void updateRegister(int address, int data);
+    int  readShadowRegister(int address);
 
 };
 
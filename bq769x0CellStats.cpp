@@ -0,0 +1,172 @@
+/* Battery management system based on bq769x0 for ARM mbed
+ * Copyright (c) 2015-2018 Martin Jäger (www.libre.solar)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "bq769x0CellStats.h"
+
+#define FILTER_FRAC_BITS 8
+
+bq769x0CellStats::bq769x0CellStats(int filterShift)
+{
+    shift = filterShift;
+    reset();
+}
+
+//----------------------------------------------------------------------------
+
+void bq769x0CellStats::reset()
+{
+    memset(cells, 0, sizeof(cells));
+    mean = 0;
+}
+
+//----------------------------------------------------------------------------
+// removes all entries from the back which are dominated by the new value
+// and entries from the front which left the window
+
+void bq769x0CellStats::push(Queue& q, uint8_t sample, uint16_t value, bool max)
+{
+    while (q.count > 0) {
+        int back = (q.head + q.count - 1) % BQ769X0_CELL_STATS_WINDOW;
+        if (max ? q.value[back] > value : q.value[back] < value) {
+            break;
+        }
+        q.count--;
+    }
+
+    if (q.count > 0 && (uint8_t)(sample - q.sample[q.head]) >= BQ769X0_CELL_STATS_WINDOW) {
+        q.head = (q.head + 1) % BQ769X0_CELL_STATS_WINDOW;
+        q.count--;
+    }
+
+    int pos = (q.head + q.count) % BQ769X0_CELL_STATS_WINDOW;
+    q.value[pos] = value;
+    q.sample[pos] = sample;
+    q.count++;
+}
+
+//----------------------------------------------------------------------------
+
+void bq769x0CellStats::update(int cell, int voltage_mV, unsigned long timestamp_ms)
+{
+    if (cell < 0 || cell >= MAX_NUMBER_OF_CELLS) {
+        return;
+    }
+    Cell& c = cells[cell];
+    uint16_t value = (voltage_mV > 0) ? voltage_mV : 0;
+
+    c.samples++;
+    push(c.min, c.samples, value, false);
+    push(c.max, c.samples, value, true);
+
+    if (c.valid == false) {
+        c.filtered = (int32_t)value << FILTER_FRAC_BITS;
+        c.slope = 0;
+        c.valid = true;
+    }
+    else {
+        int32_t previous = c.filtered;
+        c.filtered += (((int32_t)value << FILTER_FRAC_BITS) - c.filtered) >> shift;
+
+        long dt = timestamp_ms - c.timestamp;
+        if (dt > 0) {
+            // uV/s = (mV << 8) * 1000 / 256 * 1000 / ms
+            int32_t slope = (int64_t)(c.filtered - previous) * 1000000 / ((int64_t)dt << FILTER_FRAC_BITS);
+            c.slope += (slope - c.slope) >> shift;
+        }
+    }
+    c.timestamp = timestamp_ms;
+}
+
+//----------------------------------------------------------------------------
+
+void bq769x0CellStats::updateMean(unsigned int cellMask)
+{
+    int64_t sum = 0;
+    int count = 0;
+
+    for (int i = 0; i < MAX_NUMBER_OF_CELLS; i++) {
+        if ((cellMask & (1 << i)) && cells[i].valid) {
+            sum += cells[i].filtered;
+            count++;
+        }
+    }
+    if (count > 0) {
+        mean = sum / count;
+    }
+}
+
+//----------------------------------------------------------------------------
+
+bool bq769x0CellStats::isValid(int cell)
+{
+    return cell >= 0 && cell < MAX_NUMBER_OF_CELLS && cells[cell].valid;
+}
+
+//----------------------------------------------------------------------------
+
+int bq769x0CellStats::getMin(int cell)
+{
+    if (!isValid(cell)) {
+        return 0;
+    }
+    return cells[cell].min.value[cells[cell].min.head];
+}
+
+//----------------------------------------------------------------------------
+
+int bq769x0CellStats::getMax(int cell)
+{
+    if (!isValid(cell)) {
+        return 0;
+    }
+    return cells[cell].max.value[cells[cell].max.head];
+}
+
+//----------------------------------------------------------------------------
+
+int bq769x0CellStats::getFiltered(int cell)
+{
+    if (!isValid(cell)) {
+        return 0;
+    }
+    return (cells[cell].filtered + (1 << (FILTER_FRAC_BITS - 1))) >> FILTER_FRAC_BITS;
+}
+
+//----------------------------------------------------------------------------
+
+int bq769x0CellStats::getSlope(int cell)
+{
+    return isValid(cell) ? cells[cell].slope : 0;
+}
+
+//----------------------------------------------------------------------------
+
+int bq769x0CellStats::getDeviation(int cell)
+{
+    if (!isValid(cell)) {
+        return 0;
+    }
+    int32_t deviation = cells[cell].filtered - mean;
+    return (deviation + (1 << (FILTER_FRAC_BITS - 1))) >> FILTER_FRAC_BITS;
+}
+
+//----------------------------------------------------------------------------
+
+int bq769x0CellStats::getMean()
+{
+    return (mean + (1 << (FILTER_FRAC_BITS - 1))) >> FILTER_FRAC_BITS;
+}
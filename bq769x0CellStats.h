@@ -0,0 +1,91 @@
+/* Battery management system based on bq769x0 for ARM mbed
+ * Copyright (c) 2015-2018 Martin Jäger (www.libre.solar)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef BQ769X0CELLSTATS_H
+#define BQ769X0CELLSTATS_H
+
+#include "mbed.h"
+#include "bq769x0.h"
+
+#ifndef BQ769X0_CELL_STATS_WINDOW
+#define BQ769X0_CELL_STATS_WINDOW 16    // samples for rolling min/max (max. 128)
+#endif
+
+#if BQ769X0_CELL_STATS_WINDOW < 1 || BQ769X0_CELL_STATS_WINDOW > 128
+#error "BQ769X0_CELL_STATS_WINDOW must be in the range 1..128"
+#endif
+
+// Per-cell statistics of the cell voltages, updated incrementally by the
+// driver with each valid reading (see bq769x0::attachCellStats). Each sample
+// costs O(1) per cell (amortized for min/max) with fixed memory:
+//
+// - min/max of the last BQ769X0_CELL_STATS_WINDOW samples (monotonic queues)
+// - EWMA filtered voltage and its rate of change
+// - deviation of the filtered voltage from the mean of all cells
+//
+// Cells are indexed like the IC (0 = cell 1), same as BatterySnapshot. If
+// attached, the filtered voltages are also used for the balancing decision.
+
+class bq769x0CellStats {
+
+public:
+
+    // EWMA weight of new samples is 1/2^filterShift
+    bq769x0CellStats(int filterShift = 3);
+
+    void reset(void);
+
+    // new reading of one cell and mean after all cells of a sample were updated
+    void update(int cell, int voltage_mV, unsigned long timestamp_ms);
+    void updateMean(unsigned int cellMask);
+
+    bool isValid(int cell);             // at least one sample received
+    int getMin(int cell);               // mV
+    int getMax(int cell);               // mV
+    int getFiltered(int cell);          // mV
+    int getSlope(int cell);             // uV/s, filtered
+    int getDeviation(int cell);         // mV, filtered voltage vs. mean
+    int getMean(void);                  // mV, mean of filtered voltages
+
+private:
+
+    // monotonic queue: values in window, ascending (min) or descending (max)
+    struct Queue {
+        uint16_t value[BQ769X0_CELL_STATS_WINDOW];
+        uint8_t sample[BQ769X0_CELL_STATS_WINDOW];
+        uint8_t head;
+        uint8_t count;
+    };
+
+    struct Cell {
+        Queue min;
+        Queue max;
+        int32_t filtered;       // mV, 8 fractional bits
+        int32_t slope;          // uV/s
+        unsigned long timestamp;
+        uint8_t samples;        // sample counter (wraps)
+        bool valid;
+    };
+
+    Cell cells[MAX_NUMBER_OF_CELLS];
+    int shift;
+    int32_t mean;               // mV, 8 fractional bits
+
+    static void push(Queue& q, uint8_t sample, uint16_t value, bool max);
+};
+
+#endif // BQ769X0CELLSTATS_H
@@ -0,0 +1,126 @@
+/* Battery management system based on bq769x0 for ARM mbed
+ * Copyright (c) 2015-2018 Martin Jäger (www.libre.solar)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "bq769x0Diag.h"
+
+// stores value with the given number of bytes (little-endian)
+static int put(uint8_t *buf, int pos, uint64_t value, int bytes)
+{
+    for (int i = 0; i < bytes; i++) {
+        buf[pos++] = value >> (i * 8);
+    }
+    return pos;
+}
+
+//----------------------------------------------------------------------------
+
+bq769x0Diag::bq769x0Diag(bq769x0& bms) :
+    _bms(bms)
+{
+}
+
+//----------------------------------------------------------------------------
+
+int bq769x0Diag::writeFrame(uint8_t *frame, int size)
+{
+    BatterySnapshot s = _bms.getSnapshot();
+    int length = BQ769X0_DIAG_FIXED_SIZE + 2 * s.numberOfCells + 2 * s.numberOfThermistors;
+
+    if (size < length) {
+        return 0;
+    }
+
+    int pos = 0;
+    frame[pos++] = BQ769X0_DIAG_FORMAT_VERSION;
+    frame[pos++] = _bms.getNumberOfCells() / 5;
+    frame[pos++] = _bms.getI2CAddress();
+    frame[pos++] = (_bms.isCrcEnabled() ? 0x01 : 0) | (_bms.isLowPowerActive() ? 0x02 : 0);
+
+    uint64_t valid = _bms.dumpRegisters(&frame[pos]);
+    pos += NUM_DUMP_REGISTERS;
+    pos = put(frame, pos, valid, 8);
+
+    pos = put(frame, pos, _bms.getAdcGain(), 2);
+    frame[pos++] = _bms.getAdcOffset();
+
+    DriverStats stats = _bms.getStats();
+    pos = put(frame, pos, stats.i2cTransactions, 4);
+    pos = put(frame, pos, stats.i2cBytes, 4);
+    pos = put(frame, pos, stats.crcErrorsSingle, 4);
+    pos = put(frame, pos, stats.crcErrorsBurst, 4);
+    pos = put(frame, pos, stats.i2cErrors, 4);
+    pos = put(frame, pos, stats.busRecoveries, 4);
+    pos = put(frame, pos, stats.missedCCReadings, 4);
+    pos = put(frame, pos, stats.update.max_us, 4);
+    for (int i = 0; i < NUM_FAULT_COUNTERS; i++) {
+        pos = put(frame, pos, stats.faultCounts[i], 4);
+    }
+
+    pos = put(frame, pos, s.sequence, 4);
+    pos = put(frame, pos, s.timestamp, 4);
+    pos = put(frame, pos, s.batVoltage, 4);
+    pos = put(frame, pos, s.batCurrent, 4);
+    pos = put(frame, pos, s.coulombCounter, 8);
+    pos = put(frame, pos, s.errorStatus, 2);
+    pos = put(frame, pos, s.balancingStatus, 2);
+    pos = put(frame, pos, s.chargeCurrentLimit, 4);
+    pos = put(frame, pos, s.dischargeCurrentLimit, 4);
+    frame[pos++] = (s.numberOfCells & 0x1F) | ((s.numberOfThermistors & 0x03) << 5);
+    for (int i = 0; i < s.numberOfCells; i++) {
+        pos = put(frame, pos, s.cellVoltages[i], 2);
+    }
+    for (int i = 0; i < s.numberOfThermistors; i++) {
+        pos = put(frame, pos, s.temperatures[i], 2);
+    }
+
+    return pos;
+}
+
+//----------------------------------------------------------------------------
+
+int bq769x0Diag::handleCommand(const uint8_t *request, int length, uint8_t *response, int size)
+{
+    if (length < 1 || size < 2) {
+        return 0;
+    }
+
+    uint8_t command = request[0];
+    response[0] = command;
+
+    switch (command) {
+    case BQ769X0_DIAG_CMD_INFO:
+        if (size >= 4) {
+            response[1] = BQ769X0_DIAG_FORMAT_VERSION;
+            put(response, 2, BQ769X0_DIAG_FRAME_SIZE, 2);
+            return 4;
+        }
+        break;
+    case BQ769X0_DIAG_CMD_DUMP:
+        length = writeFrame(&response[1], size - 1);
+        if (length > 0) {
+            return length + 1;
+        }
+        break;
+    case BQ769X0_DIAG_CMD_RESET_STATS:
+        _bms.resetStats();
+        return 1;
+    }
+
+    response[0] = BQ769X0_DIAG_CMD_ERROR;
+    response[1] = command;
+    return 2;
+}
@@ -0,0 +1,93 @@
+/* Battery management system based on bq769x0 for ARM mbed
+ * Copyright (c) 2015-2018 Martin Jäger (www.libre.solar)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef BQ769X0DIAG_H
+#define BQ769X0DIAG_H
+
+#include "mbed.h"
+#include "bq769x0.h"
+
+#define BQ769X0_DIAG_FORMAT_VERSION 2
+#define BQ769X0_DIAG_FIXED_SIZE 182  // frame without cell voltages and temperatures
+#define BQ769X0_DIAG_FRAME_SIZE (BQ769X0_DIAG_FIXED_SIZE + 2 * MAX_NUMBER_OF_CELLS + 2 * MAX_NUMBER_OF_THERMISTORS)
+
+// commands of the diagnostics protocol (first byte of request and response)
+#define BQ769X0_DIAG_CMD_INFO        0x01
+#define BQ769X0_DIAG_CMD_DUMP        0x02
+#define BQ769X0_DIAG_CMD_RESET_STATS 0x03
+#define BQ769X0_DIAG_CMD_ERROR       0xFF
+
+// Compact binary dump of the IC registers and the driver state for remote
+// diagnostics (e.g. via CAN or BLE), available without debug build. All
+// methods access the bus, so they have to be called from the same thread as
+// the driver updates (e.g. via the event queue of bq769x0Service).
+//
+// Frame format (multi-byte values little-endian):
+//
+//  0       format version
+//  1       IC type (1: bq76920, 2: bq76930, 3: bq76940)
+//  2       I2C address
+//  3       bit 0: CRC enabled, bit 1: low-power mode active
+//  4..65   registers 0x00 to 0x33 and 0x50 to 0x59
+//  66..73  bit mask of the registers received correctly (bit 0 = byte 4)
+//  74..75  ADC gain (uV/LSB)
+//  76      ADC offset (mV, signed)
+//  77..108 32-bit counters: I2C transactions, I2C bytes, CRC errors of single
+//          register reads, CRC errors of burst reads, I2C errors, bus
+//          recoveries, missed CC readings, max. duration of update() (us)
+//  109..144 32-bit fault counters: OCD, SCD, OV, UV, OVRD_ALERT, DEVICE_XREADY,
+//          software OCC, charge temperature, discharge temperature
+//  145..   last snapshot:
+//          +0   sequence (32-bit)
+//          +4   timestamp (ms, 32-bit)
+//          +8   battery voltage (mV, 32-bit)
+//          +12  battery current (mA, signed 32-bit)
+//          +16  coulomb counter (mAs, signed 64-bit)
+//          +24  error status (16-bit)
+//          +26  balancing status (16-bit, bit 0 = cell 1)
+//          +28  charge current limit (mA, 32-bit)
+//          +32  discharge current limit (mA, 32-bit)
+//          +36  bits 0-4: number of cells n, bits 5-6: number of thermistors m
+//          +37  n cell voltages (mV, 16-bit), m temperatures (°C/10, signed 16-bit)
+//
+// Protocol: the response to each request starts with the command byte
+//
+//  INFO         response: format version, max. frame size (16-bit)
+//  DUMP         response: frame as above
+//  RESET_STATS  response: no data, resets the driver statistics
+//
+// Unknown commands or a response buffer too small are answered with ERROR
+// followed by the command byte of the request.
+
+class bq769x0Diag {
+
+public:
+
+    bq769x0Diag(bq769x0& bms);
+
+    // returns length of frame or 0 if size is not sufficient
+    int writeFrame(uint8_t *frame, int size);
+
+    // returns length of response (size should be at least BQ769X0_DIAG_FRAME_SIZE + 1)
+    int handleCommand(const uint8_t *request, int length, uint8_t *response, int size);
+
+private:
+
+    bq769x0& _bms;
+};
+
+#endif // BQ769X0DIAG_H
@@ -0,0 +1,149 @@
+/* Battery management system based on bq769x0 for ARM mbed
+ * Copyright (c) 2015-2018 Martin Jäger (www.libre.solar)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "bq769x0Log.h"
+
+bq769x0Log::bq769x0Log(uint8_t *buffer, int size)
+{
+    buf = buffer;
+    bufSize = size;
+    head = 0;
+    tail = 0;
+    used = 0;
+    droppedRecords = 0;
+}
+
+//----------------------------------------------------------------------------
+
+int bq769x0Log::encode(const BatterySnapshot& s, uint8_t *record)
+{
+    int pos = 1;    // length is stored at the end
+
+    record[pos++] = (s.numberOfCells & 0x1F) | ((s.numberOfThermistors & 0x03) << 5);
+
+    for (int i = 0; i < 4; i++) {
+        record[pos++] = (uint32_t)s.timestamp >> (i * 8);
+    }
+    for (int i = 0; i < 4; i++) {
+        record[pos++] = (uint32_t)s.batCurrent >> (i * 8);
+    }
+    record[pos++] = s.sysStat;
+    record[pos++] = s.balancingStatus;
+    record[pos++] = s.balancingStatus >> 8;
+
+    for (int i = 0; i < s.numberOfThermistors; i++) {
+        record[pos++] = s.temperatures[i];
+        record[pos++] = s.temperatures[i] >> 8;
+    }
+
+    if (s.numberOfCells > 0) {
+        record[pos++] = s.cellVoltages[0];
+        record[pos++] = s.cellVoltages[0] >> 8;
+    }
+    for (int i = 1; i < s.numberOfCells; i++) {
+        int delta = s.cellVoltages[i] - s.cellVoltages[i-1];
+        if (delta >= -127 && delta <= 127) {
+            record[pos++] = (int8_t)delta;
+        }
+        else {
+            record[pos++] = 0x80;
+            record[pos++] = delta;
+            record[pos++] = delta >> 8;
+        }
+    }
+
+    record[0] = pos;
+    return pos;
+}
+
+//----------------------------------------------------------------------------
+
+bool bq769x0Log::write(const BatterySnapshot& snapshot)
+{
+    uint8_t record[BQ769X0_LOG_MAX_RECORD_SIZE];
+    int length = encode(snapshot, record);
+
+    if (length > bufSize) {
+        return false;
+    }
+
+    CriticalSectionLock lock;
+
+    // overwrite oldest records if necessary
+    while (bufSize - used < length) {
+        int oldLength = buf[tail];
+        tail = (tail + oldLength) % bufSize;
+        used -= oldLength;
+        droppedRecords++;
+    }
+
+    for (int i = 0; i < length; i++) {
+        buf[head] = record[i];
+        head = (head + 1) % bufSize;
+    }
+    used += length;
+
+    return true;
+}
+
+//----------------------------------------------------------------------------
+
+int bq769x0Log::read(uint8_t *data, int size)
+{
+    int count = 0;
+
+    CriticalSectionLock lock;
+
+    while (used > 0 && buf[tail] <= size - count) {
+        int length = buf[tail];
+        for (int i = 0; i < length; i++) {
+            data[count++] = buf[tail];
+            tail = (tail + 1) % bufSize;
+        }
+        used -= length;
+    }
+
+    return count;
+}
+
+//----------------------------------------------------------------------------
+
+int bq769x0Log::drain(Callback<void(const uint8_t*, int)> output)
+{
+    uint8_t block[BQ769X0_LOG_MAX_RECORD_SIZE * 2];
+    int total = 0;
+    int count;
+
+    while ((count = read(block, sizeof(block))) > 0) {
+        output(block, count);
+        total += count;
+    }
+    return total;
+}
+
+//----------------------------------------------------------------------------
+
+int bq769x0Log::getNumberOfBytes()
+{
+    return used;
+}
+
+//----------------------------------------------------------------------------
+
+unsigned long bq769x0Log::getDroppedRecords()
+{
+    return droppedRecords;
+}
@@ -0,0 +1,73 @@
+/* Battery management system based on bq769x0 for ARM mbed
+ * Copyright (c) 2015-2018 Martin Jäger (www.libre.solar)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef BQ769X0LOG_H
+#define BQ769X0LOG_H
+
+#include "mbed.h"
+#include "bq769x0.h"
+
+#define BQ769X0_LOG_FORMAT_VERSION 1
+#define BQ769X0_LOG_MAX_RECORD_SIZE (13 + 2 * MAX_NUMBER_OF_THERMISTORS + 3 * MAX_NUMBER_OF_CELLS)
+
+// Ring buffer of binary records written after each update of the driver. If
+// the buffer is full, the oldest records are overwritten. The memory is
+// provided by the application, so no heap allocation is necessary.
+//
+// Record format (multi-byte values little-endian):
+//
+//  0       record length in bytes (including this byte)
+//  1       bits 0-4: number of cells n, bits 5-6: number of thermistors m
+//  2..5    timestamp (ms)
+//  6..9    battery current (mA, signed)
+//  10      SYS_STAT register
+//  11..12  balancing status (bit 0 = cell 1)
+//  13..    m temperatures (°C/10, signed 16-bit)
+//  ..      voltage of cell 1 (mV, 16-bit), followed by n-1 differences to
+//          the previous cell: 1 byte signed, or 0x80 followed by 16-bit
+//          signed difference if out of range
+
+class bq769x0Log {
+
+public:
+
+    bq769x0Log(uint8_t *buffer, int size);
+
+    bool write(const BatterySnapshot& snapshot);
+
+    // copies complete records to data and removes them from the buffer
+    // (returns number of bytes copied)
+    int read(uint8_t *data, int size);
+
+    // reads all records and passes them in blocks to output (e.g. for SD card)
+    int drain(Callback<void(const uint8_t*, int)> output);
+
+    int getNumberOfBytes(void);
+    unsigned long getDroppedRecords(void);
+
+private:
+
+    uint8_t *buf;
+    int bufSize;
+    int head;       // write position
+    int tail;       // read position, always at start of a record
+    int used;       // bytes in buffer
+    unsigned long droppedRecords;
+
+    int encode(const BatterySnapshot& snapshot, uint8_t *record);
+};
+
+#endif // BQ769X0LOG_H
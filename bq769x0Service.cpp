@@ -0,0 +1,83 @@
+/* Battery management system based on bq769x0 for ARM mbed
+ * Copyright (c) 2015-2018 Martin Jäger (www.libre.solar)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "bq769x0Service.h"
+
+#if MBED_CONF_RTOS_PRESENT
+
+bq769x0Service::bq769x0Service(bq769x0& bms, int updateInterval_ms,
+    osPriority priority, uint32_t stackSize):
+    _bms(bms), _thread(priority, stackSize)
+{
+    this->updateInterval_ms = updateInterval_ms;
+    updateEventId = 0;
+}
+
+//----------------------------------------------------------------------------
+
+void bq769x0Service::start()
+{
+    _bms.attachAlertHandler(callback(this, &bq769x0Service::alertInterruptHandler));
+
+    // check status once at start-up to clear errors and get first CC reading
+    _queue.call(this, &bq769x0Service::handleAlert);
+    setUpdateInterval(updateInterval_ms);
+
+    _thread.start(callback(&_queue, &EventQueue::dispatch_forever));
+}
+
+//----------------------------------------------------------------------------
+
+void bq769x0Service::setUpdateInterval(int interval_ms)
+{
+    updateInterval_ms = interval_ms;
+
+    if (updateEventId != 0) {
+        _queue.cancel(updateEventId);
+    }
+    updateEventId = _queue.call_every(updateInterval_ms, this, &bq769x0Service::handleUpdate);
+}
+
+//----------------------------------------------------------------------------
+
+EventQueue* bq769x0Service::getEventQueue()
+{
+    return &_queue;
+}
+
+//----------------------------------------------------------------------------
+// defers the ALERT interrupt (CC_READY or error) to the service thread
+
+void bq769x0Service::alertInterruptHandler()
+{
+    _queue.call(this, &bq769x0Service::handleAlert);
+}
+
+//----------------------------------------------------------------------------
+
+void bq769x0Service::handleAlert()
+{
+    _bms.checkStatus();     // reads new current value if CC_READY is set
+}
+
+//----------------------------------------------------------------------------
+
+void bq769x0Service::handleUpdate()
+{
+    _bms.update();
+}
+
+#endif // MBED_CONF_RTOS_PRESENT
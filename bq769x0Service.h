@@ -0,0 +1,58 @@
+/* Battery management system based on bq769x0 for ARM mbed
+ * Copyright (c) 2015-2018 Martin Jäger (www.libre.solar)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef BQ769X0SERVICE_H
+#define BQ769X0SERVICE_H
+
+#include "mbed.h"
+#include "bq769x0.h"
+
+#if MBED_CONF_RTOS_PRESENT
+
+// Runs the bq769x0 driver in its own thread: the current is read as soon as
+// the IC signals CC_READY via the ALERT pin, while voltages and temperatures
+// are updated with a configurable interval. All other calls to the driver
+// should be posted to getEventQueue() to avoid concurrent bus access.
+
+class bq769x0Service {
+
+public:
+
+    bq769x0Service(bq769x0& bms, int updateInterval_ms = 250,
+        osPriority priority = osPriorityAboveNormal, uint32_t stackSize = OS_STACK_SIZE);
+
+    void start(void);
+    void setUpdateInterval(int interval_ms);
+
+    EventQueue* getEventQueue(void);
+
+private:
+
+    bq769x0& _bms;
+    Thread _thread;
+    EventQueue _queue;
+
+    int updateInterval_ms;
+    int updateEventId;
+
+    void alertInterruptHandler(void);   // interrupt context
+    void handleAlert(void);             // service thread
+    void handleUpdate(void);            // service thread
+};
+
+#endif // MBED_CONF_RTOS_PRESENT
+
+#endif // BQ769X0SERVICE_H
@@ -0,0 +1,316 @@
+/* Battery management system based on bq769x0 for ARM mbed
+ * Copyright (c) 2015-2018 Martin Jäger (www.libre.solar)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "bq769x0Soc.h"
+
+// uncertainty added per second independent of the current (CC offset drift
+// and self-discharge, corresponds to approx. 1 % per day)
+#define SOC_DRIFT_VARIANCE_PER_S 1.2e-9f
+
+#define SOC_INITIAL_VARIANCE_MAX 0.25f  // 50 % standard deviation
+
+// index i of ascending axis with axis[i] <= value < axis[i+1], limited to the
+// segments 0 to n-2
+template <typename T>
+static int findSegment(const T *axis, int n, int value)
+{
+    int low = 0;
+    int high = n - 2;
+
+    while (low < high) {
+        int mid = (low + high + 1) / 2;
+        if (axis[mid] <= value) {
+            low = mid;
+        }
+        else {
+            high = mid - 1;
+        }
+    }
+    return low;
+}
+
+//----------------------------------------------------------------------------
+
+bq769x0Soc::bq769x0Soc(const OcvTable& table, long capacity_mAh, int cellResistance_mOhm) :
+    ocv(table)
+{
+    setCapacity(capacity_mAh);
+    cellResistance = cellResistance_mOhm;
+    setNoise();
+    reset();
+}
+
+//----------------------------------------------------------------------------
+
+void bq769x0Soc::setCapacity(long capacity_mAh)
+{
+    capacity = (int64_t)capacity_mAh * 3600;
+}
+
+//----------------------------------------------------------------------------
+
+void bq769x0Soc::setCellResistance(int resistance_mOhm)
+{
+    cellResistance = resistance_mOhm;
+}
+
+//----------------------------------------------------------------------------
+
+void bq769x0Soc::setNoise(float ccError, float voltageNoise_mV, float polarization_mV_per_A)
+{
+    ccVariance = ccError * ccError;
+    voltageVariance = voltageNoise_mV * voltageNoise_mV;
+    polarization = polarization_mV_per_A / 1000;
+}
+
+//----------------------------------------------------------------------------
+
+void bq769x0Soc::reset(float percent)
+{
+    if (percent >= 0 && percent <= 100) {
+        x = percent / 100;
+        P = 1e-4f;              // 1 % standard deviation
+        initialized = true;
+    }
+    else {
+        x = 0;
+        P = SOC_INITIAL_VARIANCE_MAX;
+        initialized = false;     // initialized from OCV in next update
+    }
+    lastValid = false;
+}
+
+//----------------------------------------------------------------------------
+
+void bq769x0Soc::shiftCoulombCounter(int64_t offset_mAs)
+{
+    lastCoulombCounter += offset_mAs;
+}
+
+//----------------------------------------------------------------------------
+
+float bq769x0Soc::getSOC(void)
+{
+    return x * 100;
+}
+
+//----------------------------------------------------------------------------
+
+float bq769x0Soc::getUncertainty(void)
+{
+    return sqrtf(P) * 100;
+}
+
+//----------------------------------------------------------------------------
+
+bool bq769x0Soc::isInitialized(void)
+{
+    return initialized;
+}
+
+//----------------------------------------------------------------------------
+// row of the table below temperature and weight of the next row (16 fractional bits)
+
+int bq769x0Soc::findRow(int temperature, int32_t *weight)
+{
+    *weight = 0;
+    if (ocv.numTemperatures < 2 || temperature <= ocv.temperatures[0]) {
+        return 0;
+    }
+    if (temperature >= ocv.temperatures[ocv.numTemperatures - 1]) {
+        return ocv.numTemperatures - 1;
+    }
+
+    int row = findSegment(ocv.temperatures, ocv.numTemperatures, temperature);
+    *weight = ((int32_t)(temperature - ocv.temperatures[row]) << 16) /
+        (ocv.temperatures[row + 1] - ocv.temperatures[row]);
+    return row;
+}
+
+//----------------------------------------------------------------------------
+
+int bq769x0Soc::getRowVoltage(int row, int32_t weight, int index)
+{
+    const uint16_t *v = &ocv.voltages[row * ocv.numPoints + index];
+
+    if (weight == 0) {
+        return v[0];
+    }
+    return v[0] + (int)(((int64_t)(v[ocv.numPoints] - v[0]) * weight) >> 16);
+}
+
+//----------------------------------------------------------------------------
+
+int bq769x0Soc::getOcv(int soc, int temperature, int *slope)
+{
+    int32_t weight;
+    int row = findRow(temperature, &weight);
+    int n = ocv.numPoints;
+
+    if (slope != NULL) {
+        *slope = 0;     // OCV is constant outside of the table
+    }
+    if (soc <= ocv.soc[0]) {
+        return getRowVoltage(row, weight, 0);
+    }
+    if (soc >= ocv.soc[n - 1]) {
+        return getRowVoltage(row, weight, n - 1);
+    }
+
+    int i = findSegment(ocv.soc, n, soc);
+    int v0 = getRowVoltage(row, weight, i);
+    int v1 = getRowVoltage(row, weight, i + 1);
+    int ds = ocv.soc[i + 1] - ocv.soc[i];
+
+    if (slope != NULL) {
+        *slope = (v1 - v0) * 10000 / ds;
+    }
+    return v0 + (v1 - v0) * (soc - ocv.soc[i]) / ds;
+}
+
+//----------------------------------------------------------------------------
+
+int bq769x0Soc::getSocFromOcv(int voltage, int temperature)
+{
+    int32_t weight;
+    int row = findRow(temperature, &weight);
+    int n = ocv.numPoints;
+
+    if (voltage <= getRowVoltage(row, weight, 0)) {
+        return ocv.soc[0];
+    }
+    if (voltage >= getRowVoltage(row, weight, n - 1)) {
+        return ocv.soc[n - 1];
+    }
+
+    // same as findSegment, but voltages of the row are interpolated on the fly
+    int low = 0;
+    int high = n - 2;
+    while (low < high) {
+        int mid = (low + high + 1) / 2;
+        if (getRowVoltage(row, weight, mid) <= voltage) {
+            low = mid;
+        }
+        else {
+            high = mid - 1;
+        }
+    }
+
+    int v0 = getRowVoltage(row, weight, low);
+    int v1 = getRowVoltage(row, weight, low + 1);
+    if (v1 <= v0) {
+        return ocv.soc[low];
+    }
+    return ocv.soc[low] + (ocv.soc[low + 1] - ocv.soc[low]) * (voltage - v0) / (v1 - v0);
+}
+
+//----------------------------------------------------------------------------
+// average of valid cell voltages (0 if none was received in last update)
+
+int bq769x0Soc::averageCellVoltage(const BatterySnapshot& s)
+{
+    long sum = 0;
+    int cells = 0;
+
+    for (int i = 0; i < s.numberOfCells; i++) {
+        if ((s.cellVoltagesValid & (1 << i)) && s.cellVoltages[i] > 500) {
+            sum += s.cellVoltages[i];
+            cells++;
+        }
+    }
+    return (cells > 0) ? sum / cells : 0;
+}
+
+//----------------------------------------------------------------------------
+// average of valid temperatures (25 °C if no sensor is available)
+
+int bq769x0Soc::averageTemperature(const BatterySnapshot& s)
+{
+    int sum = 0;
+    int sensors = 0;
+
+    for (int i = 0; i < s.numberOfThermistors; i++) {
+        if (s.temperatureAge[i] != READING_AGE_UNKNOWN) {
+            sum += s.temperatures[i];
+            sensors++;
+        }
+    }
+    return (sensors > 0) ? sum / sensors : 250;
+}
+
+//----------------------------------------------------------------------------
+
+void bq769x0Soc::update(const BatterySnapshot& s)
+{
+    if (ocv.numPoints < 2 || capacity <= 0) {
+        return;
+    }
+
+    int voltage = averageCellVoltage(s);
+    int temperature = averageTemperature(s);
+    float noise = polarization * s.batCurrent;
+    float R = voltageVariance + noise * noise;     // measurement variance (mV^2)
+    int ohmicDrop = s.batCurrent * cellResistance / 1000;   // mV, positive for charging
+
+    if (!initialized) {
+        if (voltage == 0) {
+            return;
+        }
+        int slope;
+        x = getSocFromOcv(voltage - ohmicDrop, temperature) * 0.0001f;
+        getOcv(x * 10000, temperature, &slope);
+        P = (slope != 0) ? R / ((float)slope * slope) : SOC_INITIAL_VARIANCE_MAX;
+        if (P > SOC_INITIAL_VARIANCE_MAX) {
+            P = SOC_INITIAL_VARIANCE_MAX;
+        }
+        initialized = true;
+        lastCoulombCounter = s.coulombCounter;
+        lastTimestamp = s.timestamp;
+        lastValid = true;
+        return;
+    }
+
+    // prediction based on the charge since the last update
+    if (lastValid) {
+        float dx = (float)(s.coulombCounter - lastCoulombCounter) / capacity;
+        x += dx;
+        P += dx * dx * ccVariance + (s.timestamp - lastTimestamp) * (SOC_DRIFT_VARIANCE_PER_S / 1000);
+    }
+    lastCoulombCounter = s.coulombCounter;
+    lastTimestamp = s.timestamp;
+    lastValid = true;
+
+    // correction based on cell voltage
+    if (voltage > 0) {
+        int soc = (x < 0) ? 0 : (x > 1 ? 10000 : x * 10000);
+        int slope;
+        int predicted = getOcv(soc, temperature, &slope) + ohmicDrop;
+        float H = slope;                    // mV per 100 % SOC
+        float S = H * P * H + R;
+        float K = P * H / S;
+
+        x += K * (voltage - predicted);
+        P = P * R / S;                      // = (1 - K*H) * P
+    }
+
+    if (x < 0) {
+        x = 0;
+    }
+    else if (x > 1) {
+        x = 1;
+    }
+}
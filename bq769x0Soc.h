@@ -0,0 +1,105 @@
+/* Battery management system based on bq769x0 for ARM mbed
+ * Copyright (c) 2015-2018 Martin Jäger (www.libre.solar)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef BQ769X0SOC_H
+#define BQ769X0SOC_H
+
+#include "mbed.h"
+#include "bq769x0.h"
+
+// Open circuit voltage of a cell vs. SOC for several temperatures. The data
+// is not copied, so it should be declared const to stay in flash.
+//
+// Both axes must be in ascending order and the voltages must increase with
+// SOC. Temperatures outside of the table are clamped to the first or last row.
+struct OcvTable {
+    uint8_t numTemperatures;
+    uint8_t numPoints;
+    const int16_t *temperatures;    // °C/10
+    const uint16_t *soc;            // 0.01 %, e.g. 0 to 10000
+    const uint16_t *voltages;       // mV, numTemperatures rows of numPoints values
+};
+
+// State of charge estimation with an extended Kalman filter
+//
+// The SOC predicted from the coulomb counter of the driver is corrected with
+// the average cell voltage, compared against the OCV at the estimated SOC
+// plus the ohmic voltage drop. The voltage is trusted less with increasing
+// current, as the polarization of the cells is not modelled, and in flat
+// regions of the OCV curve the filter automatically relies on the coulomb
+// counter. Each update has a constant cost apart from two binary searches.
+
+class bq769x0Soc {
+
+public:
+
+    bq769x0Soc(const OcvTable& table, long capacity_mAh, int cellResistance_mOhm = 0);
+
+    // called by the driver after each update (see bq769x0::attachSocEstimator)
+    void update(const BatterySnapshot& snapshot);
+
+    // SOC in % and its standard deviation
+    float getSOC(void);
+    float getUncertainty(void);
+    bool isInitialized(void);
+
+    // starts with known SOC, or from OCV of next update if percent < 0
+    void reset(float percent = -1);
+
+    // called by the driver if its coulomb counter was set (e.g. resetSOC), so
+    // that the jump is not taken as charge in the next update
+    void shiftCoulombCounter(int64_t offset_mAs);
+
+    // ccError: relative error of the coulomb counter
+    // voltageNoise_mV: voltage error (incl. OCV table) in rest
+    // polarization_mV_per_A: additional voltage uncertainty under load
+    void setNoise(float ccError = 0.01, float voltageNoise_mV = 10, float polarization_mV_per_A = 50);
+
+    void setCapacity(long capacity_mAh);
+    void setCellResistance(int resistance_mOhm);
+
+    // table lookup with fixed-point interpolation: voltage in mV and slope
+    // in mV per 100 % SOC (optional) for SOC in 0.01 %
+    int getOcv(int soc, int temperature, int *slope = NULL);
+
+    // inverse lookup: SOC in 0.01 % for OCV in mV
+    int getSocFromOcv(int voltage, int temperature);
+
+private:
+
+    const OcvTable& ocv;
+    int64_t capacity;           // mAs
+    int cellResistance;         // mOhm
+
+    float ccVariance;           // square of relative CC error
+    float voltageVariance;      // mV^2
+    float polarization;         // mV/mA
+
+    float x;                    // SOC (0..1)
+    float P;                    // variance of x
+    bool initialized;
+    int64_t lastCoulombCounter; // mAs
+    unsigned long lastTimestamp;    // ms
+    bool lastValid;
+
+    int findRow(int temperature, int32_t *weight);
+    int getRowVoltage(int row, int32_t weight, int index);
+    int averageCellVoltage(const BatterySnapshot& s);
+    int averageTemperature(const BatterySnapshot& s);
+};
+
+#endif // BQ769X0SOC_H
@@ -0,0 +1,186 @@
+/* Battery management system based on bq769x0 for ARM mbed
+ * Copyright (c) 2015-2018 Martin Jäger (www.libre.solar)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "bq769x0Stack.h"
+
+bq769x0Stack::bq769x0Stack()
+{
+    numberOfDevices = 0;
+    packVoltage = 0;
+    minCellVoltage = 0;
+    maxCellVoltage = 0;
+    avgCellVoltage = 0;
+    connectedCells = 0;
+}
+
+//----------------------------------------------------------------------------
+
+int bq769x0Stack::addDevice(bq769x0& bms, Callback<void()> select)
+{
+    if (numberOfDevices >= MAX_NUMBER_OF_STACKED_ICS) {
+        return -1;
+    }
+
+    devices[numberOfDevices] = &bms;
+    if (select) {
+        bms.setBusSelect(select);
+    }
+    return numberOfDevices++;
+}
+
+//----------------------------------------------------------------------------
+
+int bq769x0Stack::getNumberOfDevices()
+{
+    return numberOfDevices;
+}
+
+//----------------------------------------------------------------------------
+
+bq769x0* bq769x0Stack::getDevice(int index)
+{
+    if (index >= 0 && index < numberOfDevices) {
+        return devices[index];
+    }
+    return NULL;
+}
+
+//----------------------------------------------------------------------------
+// bus transfers for measurements of all ICs first, then evaluation and
+// balancing based on the lowest cell voltage of the entire pack
+
+void bq769x0Stack::update()
+{
+    for (int i = 0; i < numberOfDevices; i++) {
+        devices[i]->updateRegisterCache();
+    }
+
+    // readings of registers not received correctly keep their last value
+    for (int i = 0; i < numberOfDevices; i++) {
+        devices[i]->processRegisterCache();
+    }
+
+    updateAggregatedValues();
+
+    for (int i = 0; i < numberOfDevices; i++) {
+        devices[i]->balancingReferenceVoltage = minCellVoltage;
+        devices[i]->finishUpdate();
+    }
+}
+
+//----------------------------------------------------------------------------
+
+void bq769x0Stack::updateAggregatedValues()
+{
+    long sum = 0;
+    int minVoltage = 0;
+    int maxVoltage = 0;
+    int cells = 0;
+
+    packVoltage = 0;
+    for (int i = 0; i < numberOfDevices; i++)
+    {
+        packVoltage += devices[i]->getBatteryVoltage();
+
+        for (int j = 1; j <= devices[i]->getNumberOfPopulatedCells(); j++) {
+            int voltage = devices[i]->getCellVoltage(j);
+            if (voltage > 500) {    // same threshold as for connected cells in bq769x0
+                if (cells == 0 || voltage < minVoltage) {
+                    minVoltage = voltage;
+                }
+                if (cells == 0 || voltage > maxVoltage) {
+                    maxVoltage = voltage;
+                }
+                sum += voltage;
+                cells++;
+            }
+        }
+    }
+
+    minCellVoltage = minVoltage;
+    maxCellVoltage = maxVoltage;
+    avgCellVoltage = (cells > 0) ? sum / cells : 0;
+    connectedCells = cells;
+}
+
+//----------------------------------------------------------------------------
+
+long bq769x0Stack::getPackVoltage()
+{
+    return packVoltage;
+}
+
+//----------------------------------------------------------------------------
+
+int bq769x0Stack::getCellVoltage(int idCell)
+{
+    for (int i = 0; i < numberOfDevices; i++) {
+        if (idCell <= devices[i]->getNumberOfPopulatedCells()) {
+            return devices[i]->getCellVoltage(idCell);
+        }
+        idCell -= devices[i]->getNumberOfPopulatedCells();
+    }
+    return 0;
+}
+
+//----------------------------------------------------------------------------
+
+int bq769x0Stack::getMinCellVoltage()
+{
+    return minCellVoltage;
+}
+
+//----------------------------------------------------------------------------
+
+int bq769x0Stack::getMaxCellVoltage()
+{
+    return maxCellVoltage;
+}
+
+//----------------------------------------------------------------------------
+
+int bq769x0Stack::getAvgCellVoltage()
+{
+    return avgCellVoltage;
+}
+
+//----------------------------------------------------------------------------
+
+int bq769x0Stack::getNumberOfCells()
+{
+    int cells = 0;
+    for (int i = 0; i < numberOfDevices; i++) {
+        cells += devices[i]->getNumberOfPopulatedCells();
+    }
+    return cells;
+}
+
+//----------------------------------------------------------------------------
+
+int bq769x0Stack::getNumberOfConnectedCells()
+{
+    return connectedCells;
+}
+
+//----------------------------------------------------------------------------
+
+unsigned int bq769x0Stack::getBalancingStatus(int index)
+{
+    if (index >= 0 && index < numberOfDevices) {
+        return devices[index]->getBalancingStatus();
+    }
+    return 0;
+}
@@ -0,0 +1,70 @@
+/* Battery management system based on bq769x0 for ARM mbed
+ * Copyright (c) 2015-2018 Martin Jäger (www.libre.solar)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef BQ769X0STACK_H
+#define BQ769X0STACK_H
+
+#include "mbed.h"
+#include "bq769x0.h"
+
+#define MAX_NUMBER_OF_STACKED_ICS 8
+
+// Manages several bq769x0 ICs connected in series, sharing one I2C bus (with
+// different addresses or behind an I2C multiplexer). Populated cells are
+// numbered from the IC added first to the IC added last.
+
+class bq769x0Stack {
+
+public:
+
+    bq769x0Stack(void);
+
+    // select is called before each bus transfer of the IC, e.g. to switch an
+    // I2C mux channel (see bq769x0::setBusSelect), returns index of the IC or
+    // -1 if stack is full
+    int addDevice(bq769x0& bms, Callback<void()> select = Callback<void()>());
+    int getNumberOfDevices(void);
+    bq769x0* getDevice(int index);
+
+    // should be called at least once every 250 ms, reads all ICs before
+    // evaluating the measurements to keep them as close in time as possible
+    void update(void);
+
+    // aggregated battery status
+    long getPackVoltage(void);              // mV
+    int  getCellVoltage(int idCell);        // from 1 to total number of cells
+    int  getMinCellVoltage(void);
+    int  getMaxCellVoltage(void);
+    int  getAvgCellVoltage(void);
+    int  getNumberOfCells(void);
+    int  getNumberOfConnectedCells(void);
+    unsigned int getBalancingStatus(int index);
+
+private:
+
+    bq769x0* devices[MAX_NUMBER_OF_STACKED_ICS];
+    int numberOfDevices;
+
+    long packVoltage;       // mV
+    int minCellVoltage;     // mV
+    int maxCellVoltage;     // mV
+    int avgCellVoltage;     // mV
+    int connectedCells;
+
+    void updateAggregatedValues(void);
+};
+
+#endif // BQ769X0STACK_H
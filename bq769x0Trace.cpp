@@ -0,0 +1,138 @@
+/* Battery management system based on bq769x0 for ARM mbed
+ * Copyright (c) 2015-2018 Martin Jäger (www.libre.solar)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "bq769x0.h"
+#include "bq769x0Trace.h"
+
+#if (BQ769X0_TRACE_BUFFER_SIZE & (BQ769X0_TRACE_BUFFER_SIZE - 1)) != 0
+#error "BQ769X0_TRACE_BUFFER_SIZE must be a power of 2"
+#endif
+
+#define TRACE_INDEX_MASK (BQ769X0_TRACE_BUFFER_SIZE - 1)
+
+TraceEntry bq769x0Trace::ring[BQ769X0_TRACE_BUFFER_SIZE];
+volatile uint32_t bq769x0Trace::writeIndex = 0;
+uint32_t bq769x0Trace::readIndex = 0;
+uint32_t bq769x0Trace::lostEntries = 0;
+
+static const char *const eventNames[TRACE_NUM_EVENTS] = {
+    "communication error",
+    "CRC error",
+    "fault",
+    "attempting to clear fault",
+    "temperature error (CHG)",
+    "clearing temperature error (CHG)",
+    "temperature error (DSG)",
+    "clearing temperature error (DSG)",
+    "CHG FET on",
+    "CHG FET off",
+    "CHG FET not enabled",
+    "DSG FET on",
+    "DSG FET off",
+    "DSG FET not enabled",
+    "balancing",
+    "SOC reset",
+    "I2C error",
+    "I2C bus recovery",
+    "charge overcurrent"
+};
+
+static const char levelNames[] = "-EWID";
+
+//----------------------------------------------------------------------------
+
+void bq769x0Trace::record(uint8_t level, uint8_t event, int32_t arg)
+{
+    // reserving the slot atomically allows concurrent writers (e.g. ISR)
+    uint32_t index = core_util_atomic_incr_u32((uint32_t *)&writeIndex, 1) - 1;
+    TraceEntry *entry = &ring[index & TRACE_INDEX_MASK];
+
+    entry->sequence = 0;
+    __DMB();
+    entry->timestamp = us_ticker_read();
+    entry->level = level;
+    entry->event = event;
+    entry->arg = arg;
+    __DMB();    // entry must be complete before it becomes valid
+    entry->sequence = index + 1;
+}
+
+//----------------------------------------------------------------------------
+
+bool bq769x0Trace::read(TraceEntry& entry)
+{
+    while (readIndex != writeIndex) {
+
+        uint32_t pending = writeIndex - readIndex;
+        if (pending > BQ769X0_TRACE_BUFFER_SIZE) {
+            // oldest entries were already overwritten
+            lostEntries += pending - BQ769X0_TRACE_BUFFER_SIZE;
+            readIndex += pending - BQ769X0_TRACE_BUFFER_SIZE;
+        }
+
+        TraceEntry *slot = &ring[readIndex & TRACE_INDEX_MASK];
+        uint32_t sequence = slot->sequence;
+        __DMB();
+        entry = *slot;
+        __DMB();
+
+        int32_t lap = (int32_t)(sequence - (readIndex + 1));
+        if (lap < 0) {
+            return false;   // entry not yet completely written, try again later
+        }
+        readIndex++;
+        if (lap == 0 && slot->sequence == sequence) {
+            return true;
+        }
+        lostEntries++;      // overwritten while reading
+    }
+    return false;
+}
+
+//----------------------------------------------------------------------------
+
+int bq769x0Trace::print()
+{
+    TraceEntry entry;
+    int count = 0;
+
+    while (read(entry)) {
+        printf("%10lu.%03lu %c %s (%ld)\n",
+            (unsigned long)(entry.timestamp / 1000000),
+            (unsigned long)(entry.timestamp / 1000 % 1000),
+            levelNames[entry.level < sizeof(levelNames) - 1 ? entry.level : 0],
+            getEventName(entry.event), (long)entry.arg);
+        count++;
+    }
+    return count;
+}
+
+//----------------------------------------------------------------------------
+
+const char *bq769x0Trace::getEventName(uint8_t event)
+{
+    if (event < TRACE_NUM_EVENTS) {
+        return eventNames[event];
+    }
+    return "unknown";
+}
+
+//----------------------------------------------------------------------------
+
+uint32_t bq769x0Trace::getLostEntries()
+{
+    return lostEntries;
+}
@@ -0,0 +1,109 @@
+/* Battery management system based on bq769x0 for ARM mbed
+ * Copyright (c) 2015-2018 Martin Jäger (www.libre.solar)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef BQ769X0TRACE_H
+#define BQ769X0TRACE_H
+
+#include "mbed.h"
+
+// trace levels
+#define BQ769X0_TRACE_OFF       0
+#define BQ769X0_TRACE_ERROR     1
+#define BQ769X0_TRACE_WARNING   2
+#define BQ769X0_TRACE_INFO      3
+#define BQ769X0_TRACE_DEBUG     4
+
+// events above this level are removed at compile time
+#ifndef BQ769X0_TRACE_LEVEL
+#if BQ769X0_DEBUG
+#define BQ769X0_TRACE_LEVEL BQ769X0_TRACE_INFO
+#else
+#define BQ769X0_TRACE_LEVEL BQ769X0_TRACE_WARNING
+#endif
+#endif
+
+// number of entries, must be a power of 2
+#ifndef BQ769X0_TRACE_BUFFER_SIZE
+#define BQ769X0_TRACE_BUFFER_SIZE 32
+#endif
+
+#define BQ769X0_TRACE(level, event, arg) \
+    do { \
+        if ((level) <= BQ769X0_TRACE_LEVEL) { \
+            bq769x0Trace::record((level), (event), (arg)); \
+        } \
+    } while (0)
+
+enum TraceEvent {
+    TRACE_COMM_ERROR,       // arg: I2C address
+    TRACE_CRC_ERROR,        // arg: register address
+    TRACE_FAULT,            // arg: SYS_STAT
+    TRACE_FAULT_CLEAR,      // arg: SYS_STAT bit to be cleared
+    TRACE_TEMP_ERROR_CHG,   // arg: temperature (°C/10)
+    TRACE_TEMP_CLEAR_CHG,
+    TRACE_TEMP_ERROR_DSG,
+    TRACE_TEMP_CLEAR_DSG,
+    TRACE_CHG_ON,
+    TRACE_CHG_OFF,
+    TRACE_CHG_REJECTED,     // arg: error status
+    TRACE_DSG_ON,
+    TRACE_DSG_OFF,
+    TRACE_DSG_REJECTED,     // arg: error status
+    TRACE_BALANCING,        // arg: balancing status
+    TRACE_SOC_RESET,        // arg: coulomb counter (mAh)
+    TRACE_I2C_ERROR,        // arg: I2C address
+    TRACE_BUS_RECOVERY,     // arg: 1 if SDA was released
+    TRACE_OCC,              // arg: current (mA)
+    TRACE_NUM_EVENTS
+};
+
+struct TraceEntry {
+    uint32_t sequence;      // position in the trace + 1, 0 while written
+    uint32_t timestamp;     // us
+    uint8_t level;
+    uint8_t event;
+    int32_t arg;
+};
+
+// Event trace shared by all driver instances. Recording only stores the event
+// ID and one argument in a ring buffer (lock-free, also usable from ISRs), so
+// the formatting via print() can be done later in a low priority thread.
+// If the consumer is too slow, the oldest entries are overwritten.
+
+class bq769x0Trace {
+
+public:
+
+    static void record(uint8_t level, uint8_t event, int32_t arg);
+
+    // gets the oldest entry not yet read (single consumer only)
+    static bool read(TraceEntry& entry);
+
+    // writes all pending entries to stdout and returns their number
+    static int print(void);
+
+    static const char *getEventName(uint8_t event);
+    static uint32_t getLostEntries(void);
+
+private:
+
+    static TraceEntry ring[BQ769X0_TRACE_BUFFER_SIZE];
+    static volatile uint32_t writeIndex;
+    static uint32_t readIndex;
+    static uint32_t lostEntries;
+};
+
+#endif // BQ769X0TRACE_H
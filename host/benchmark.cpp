@@ -0,0 +1,528 @@
+/* Battery management system based on bq769x0 for ARM mbed
+ * Copyright (c) 2015-2018 Martin Jäger (www.libre.solar)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Benchmark of the bus load and update time for the 5, 10 and 15 cell ICs and
+// regression tests of the fault handling, coulomb counter and SOC with the
+// simulated IC:
+//
+//     g++ -funsigned-char -I host -I . bq769x0*.cpp host/mbed.cpp host/bq769x0Sim.cpp host/benchmark.cpp -o benchmark
+//
+// Update times from getStats() are simulated time (mainly bus transfers at
+// 100 kHz), CPU time is measured on the host. Returns 1 if a test failed.
+
+#include "mbed.h"
+#include "bq769x0.h"
+#include "bq769x0Sim.h"
+#include "bq769x0Soc.h"
+#include "bq769x0Stack.h"
+#include "bq769x0CellStats.h"
+#include "bq769x0Diag.h"
+#include "registers.h"
+
+#include <time.h>
+
+#define SHUNT_MOHM 1.0f
+#define BENCHMARK_UPDATES 4000      // 1000 s with update() every 250 ms
+
+#define FET_CHG 0b01
+#define FET_DSG 0b10
+
+#define ALERT_PIN 3
+
+// simulated IC on a bus of its own, connected before the driver is created
+struct SimBus {
+    I2C i2c;
+    bq769x0Sim sim;
+
+    SimBus(int type) : i2c(1, 2), sim(type)
+    {
+        sim.connect(i2c, ALERT_PIN);
+    }
+};
+
+struct TestSetup : SimBus {
+    bq769x0 bms;
+
+    TestSetup(int type) : SimBus(type), bms(i2c, ALERT_PIN, type)
+    {
+        bms.setShuntResistorValue(SHUNT_MOHM);
+        bms.setTemperatureLimits(-20, 60, 0, 45);
+        bms.setCellOvervoltageProtection(4200, 2);
+        bms.setCellUndervoltageProtection(2900, 2);
+        bms.setShortCircuitProtection(50000, 200);
+        bms.setOvercurrentDischargeProtection(20000, 320);
+        bms.setOvercurrentChargeProtection(5000, 1000);
+        run(2);
+        bms.enableCharging();
+        bms.enableDischarging();
+    }
+
+    void run(float seconds, int interval_ms = 250)
+    {
+        for (int i = 0; i < (int)(seconds * 1000 / interval_ms); i++) {
+            wait_ms(interval_ms);
+            bms.update();
+        }
+    }
+
+    int fets(void)
+    {
+        return sim.getRegister(SYS_CTRL2) & (FET_CHG | FET_DSG);
+    }
+
+    // occurrences of the fault with the given errorStatus bit
+    uint32_t faultCount(int flag)
+    {
+        int index = (flag == BQ769X0_ERR_OCC) ? FAULT_COUNT_OCC : __builtin_ctz(flag);
+        return bms.getStats().faultCounts[index];
+    }
+};
+
+static int failures = 0;
+
+//----------------------------------------------------------------------------
+
+static void check(const char *test, const char *condition, bool passed)
+{
+    if (!passed) {
+        printf("FAIL %s: %s\n", test, condition);
+        failures++;
+    }
+}
+
+//----------------------------------------------------------------------------
+// bus transactions, bytes and time per update in normal operation with
+// balancing enabled
+
+static void benchmark(int type, int cells)
+{
+    TestSetup t(type);
+
+    for (int i = 1; i <= cells; i++) {
+        t.sim.setCellVoltage(i, 3550 + i * 5);
+    }
+    t.bms.setBalancingThresholds(0, 3400, 10);
+    t.bms.enableAutoBalancing();
+    t.run(2);
+
+    t.bms.resetStats();
+    t.sim.resetStatistics();
+    clock_t start = clock();
+    t.run(BENCHMARK_UPDATES / 4);
+    double cpu_us = (double)(clock() - start) * 1e6 / CLOCKS_PER_SEC / BENCHMARK_UPDATES;
+
+    DriverStats stats = t.bms.getStats();
+    printf("%2d cells: %5.2f transactions, %6.1f bytes, update avg %5lu us, max %5lu us, "
+        "checkStatus avg %4lu us, CPU %6.2f us\n", cells,
+        (float)t.sim.getTransactions() / BENCHMARK_UPDATES,
+        (float)t.sim.getBytes() / BENCHMARK_UPDATES,
+        (unsigned long)stats.update.avg_us, (unsigned long)stats.update.max_us,
+        (unsigned long)stats.checkStatus.avg_us, cpu_us);
+
+    check("benchmark", "no error", t.bms.checkStatus() == 0);
+    check("benchmark", "balancing active", t.bms.getBalancingStatus() != 0);
+}
+
+//----------------------------------------------------------------------------
+// fault caused by the given condition, FETs switched off and recovered after
+// the condition was removed
+
+static void testVoltageFault(const char *test, int voltage_mV, int flag, int fetsOff)
+{
+    TestSetup t(bq76940);
+
+    t.sim.setCellVoltage(3, voltage_mV);
+    t.run(4);
+    check(test, "fault detected", t.bms.checkStatus() & flag);
+    check(test, "FET switched off", (t.fets() & fetsOff) == 0);
+    check(test, "fault counted", t.faultCount(flag) == 1);
+
+    t.sim.setCellVoltage(3, 3600);
+    t.run(4);
+    check(test, "fault cleared", t.bms.checkStatus() == 0);
+    check(test, "FETs enabled again", t.fets() == (FET_CHG | FET_DSG));
+}
+
+//----------------------------------------------------------------------------
+
+static void testCurrentFault(const char *test, long current_mA, int flag, int fetsOff)
+{
+    TestSetup t(bq76940);
+
+    t.sim.setCurrent(current_mA, SHUNT_MOHM);
+    t.run(2);
+    check(test, "fault detected", t.bms.checkStatus() & flag);
+    check(test, "FET switched off", (t.fets() & fetsOff) == 0);
+    check(test, "fault counted", t.faultCount(flag) == 1);
+
+    t.sim.setCurrent(0, SHUNT_MOHM);
+    t.run(30);
+    check(test, "retry interval kept", t.bms.checkStatus() & flag);
+
+    t.run(35);
+    check(test, "fault cleared", t.bms.checkStatus() == 0);
+    check(test, "FETs enabled again", t.fets() == (FET_CHG | FET_DSG));
+}
+
+//----------------------------------------------------------------------------
+
+static void testXready(void)
+{
+    TestSetup t(bq76940);
+
+    t.sim.injectFault(STAT_DEVICE_XREADY);
+    t.run(1);
+    check("XR", "fault detected", t.bms.checkStatus() & STAT_DEVICE_XREADY);
+    check("XR", "FETs switched off", t.fets() == 0);
+    check("XR", "fault counted", t.faultCount(STAT_DEVICE_XREADY) == 1);
+
+    t.run(4);
+    check("XR", "fault cleared", t.bms.checkStatus() == 0);
+    check("XR", "FETs enabled again", t.fets() == (FET_CHG | FET_DSG));
+}
+
+//----------------------------------------------------------------------------
+// UV cleared while the software OCC is still latched: DSG must be enabled
+// after the OCC recovery
+
+static void testUndervoltageAndOcc(void)
+{
+    TestSetup t(bq76940);
+
+    t.sim.setCurrent(8000, SHUNT_MOHM);
+    t.sim.setCellVoltage(3, 2500);
+    t.run(4);
+    check("UV+OCC", "faults detected", (t.bms.checkStatus() & (STAT_UV | BQ769X0_ERR_OCC)) ==
+        (STAT_UV | BQ769X0_ERR_OCC));
+    check("UV+OCC", "FETs switched off", t.fets() == 0);
+
+    t.sim.setCurrent(0, SHUNT_MOHM);
+    t.sim.setCellVoltage(3, 3600);
+    t.run(65);
+    check("UV+OCC", "faults cleared", t.bms.checkStatus() == 0);
+    check("UV+OCC", "FETs enabled again", t.fets() == (FET_CHG | FET_DSG));
+}
+
+//----------------------------------------------------------------------------
+// reset of the UV flag not acknowledged by the IC, without CC_READY alerts
+
+static void testFailedClear(void)
+{
+    TestSetup t(bq76940);
+
+    t.sim.setCellVoltage(3, 2500);
+    t.run(4);
+    check("clear NACK", "fault detected", t.bms.checkStatus() & STAT_UV);
+
+    t.sim.setRegister(SYS_CTRL2, t.sim.getRegister(SYS_CTRL2) & ~0x40);   // CC_EN
+    t.sim.setCellVoltage(3, 3600);
+    t.sim.injectWriteNack(SYS_STAT, 20);
+    t.run(10);
+    check("clear NACK", "fault cleared", t.bms.checkStatus() == 0);
+    check("clear NACK", "flag reset in IC", t.sim.getRegister(SYS_STAT) == 0);
+    check("clear NACK", "FETs enabled again", t.fets() == (FET_CHG | FET_DSG));
+}
+
+//----------------------------------------------------------------------------
+// bus errors must neither cause faults nor wrong measurements
+
+static void testBusErrors(void)
+{
+    TestSetup t(bq76940);
+
+    t.sim.setCellVoltages(3700);
+    t.run(1);
+    t.bms.resetStats();
+
+    t.sim.injectCrcError(3);
+    t.run(1);
+    t.sim.injectCrcError(3, 10);
+    t.run(1);
+    t.sim.injectNack(3);
+    t.run(1);
+    t.sim.injectNack(20);
+    t.run(2);
+
+    DriverStats stats = t.bms.getStats();
+    check("bus errors", "CRC errors counted", stats.crcErrorsSingle + stats.crcErrorsBurst >= 6);
+    check("bus errors", "NACKs counted", stats.i2cErrors >= 3);
+    check("bus errors", "no fault", t.bms.checkStatus() == 0);
+    check("bus errors", "FETs still enabled", t.fets() == (FET_CHG | FET_DSG));
+
+    t.run(1);
+    check("bus errors", "valid cell voltage", abs(t.bms.getCellVoltage(5) - 3700) < 10);
+}
+
+//----------------------------------------------------------------------------
+// charge integrated by the coulomb counter for polling intervals which are not
+// synchronized with the CC conversions
+
+static void testCoulombCounter(int interval_ms)
+{
+    char test[32];
+    snprintf(test, sizeof(test), "CC %d ms", interval_ms);
+
+    TestSetup t(bq76940);
+    t.bms.setBatteryCapacity(1000);
+    t.bms.resetSOC(50);
+    t.bms.resetStats();
+    float initial = t.bms.getSOC();
+
+    // update() itself takes some time, so the exact discharge time is used
+    uint64_t start_us = HostTime::read_us();
+    t.sim.setCurrent(-10000, SHUNT_MOHM);
+    t.run(90, interval_ms);
+    t.sim.setCurrent(0, SHUNT_MOHM);
+    float expected_mAh = 10000.0f * (HostTime::read_us() - start_us) / 3.6e9f;
+    t.run(2, interval_ms);
+
+    float charge_mAh = (initial - t.bms.getSOC()) * 10;
+    check(test, "integrated charge", fabsf(charge_mAh - expected_mAh) < expected_mAh * 0.01f);
+    if (interval_ms <= 250) {
+        check(test, "no missed readings", t.bms.getMissedCCReadings() == 0);
+    }
+    else if (interval_ms >= 500) {
+        check(test, "missed readings counted", t.bms.getMissedCCReadings() > 0);
+    }
+}
+
+//----------------------------------------------------------------------------
+// only voltages of ADC conversions without balancing current may be used for
+// the cell statistics
+
+static void testBalancingWindow(void)
+{
+    TestSetup t(bq76940);
+    bq769x0CellStats cellStats;
+
+    t.sim.setCellVoltages(3600);
+    t.sim.setCellVoltage(3, 3700);
+    t.sim.setBalancingVoltageDrop(50);
+    t.bms.setBalancingThresholds(0, 3400, 10);
+    t.bms.setBalancingMeasurementWindow(5, 100);
+    t.bms.attachCellStats(&cellStats);
+    t.bms.enableAutoBalancing();
+    t.run(60);
+
+    // cell 3 is index 2
+    check("balancing window", "cell balanced", t.bms.getBalancingStatus() & (1 << 2));
+    check("balancing window", "unbiased samples", cellStats.getMin(2) > 3690);
+}
+
+//----------------------------------------------------------------------------
+// fault counters in the diagnostics frame
+
+static void testDiagFrame(void)
+{
+    TestSetup t(bq76940);
+    bq769x0Diag diag(t.bms);
+    uint8_t frame[BQ769X0_DIAG_FRAME_SIZE];
+
+    t.sim.setCellVoltage(3, 2500);
+    t.run(4);
+    t.sim.setCellVoltage(3, 3600);
+    t.sim.setTemperature(1, 50);    // above charge limit
+    t.run(4);
+
+    DriverStats stats = t.bms.getStats();
+    check("diag frame", "temperature fault counted", stats.faultCounts[FAULT_COUNT_TEMP_CHG] == 1 &&
+        stats.faultCounts[FAULT_COUNT_TEMP_DSG] == 0);
+
+    int length = diag.writeFrame(frame, sizeof(frame));
+    check("diag frame", "frame length", length == BQ769X0_DIAG_FRAME_SIZE);
+
+    int pos = 109 + FAULT_COUNT_UV * 4;
+    uint32_t count = frame[pos] | frame[pos + 1] << 8 | frame[pos + 2] << 16 | frame[pos + 3] << 24;
+    check("diag frame", "UV fault counter", count == 1);
+}
+
+//----------------------------------------------------------------------------
+// thermistor readings not received at start-up must not be taken as 0 °C
+
+static void testMissingTemperature(void)
+{
+    SimBus bus(bq76940);
+    bq769x0 bms(bus.i2c, ALERT_PIN, bq76940);
+
+    bms.setShuntResistorValue(SHUNT_MOHM);
+    bms.setTemperatureLimits(-20, 60, 5, 45);
+    bms.setCellOvervoltageProtection(4200, 2);
+    bms.setCellUndervoltageProtection(2900, 2);
+    bms.setCurrentLimits(10000, 10000);
+
+    bus.sim.injectCrcError(1, TS1_HI_BYTE);     // TS1 of first update
+    wait_ms(250);
+    bms.update();
+    check("missing temperature", "TS1 not valid", (bms.getSnapshot().temperaturesValid & 1) == 0);
+    check("missing temperature", "charging allowed", bms.enableCharging());
+    check("missing temperature", "charge current not derated", bms.getChargeCurrentLimit() == 10000);
+}
+
+//----------------------------------------------------------------------------
+// SOC set before the shunt resistor value is known
+
+static void testEarlySocReset(void)
+{
+    SimBus bus(bq76940);
+    bq769x0 bms(bus.i2c, ALERT_PIN, bq76940);
+
+    bms.setBatteryCapacity(1000);
+    bms.resetSOC(50);
+    bms.setShuntResistorValue(SHUNT_MOHM);
+    for (int i = 0; i < 8; i++) {
+        wait_ms(250);
+        bms.update();
+    }
+    check("early SOC reset", "charge kept", fabsf(bms.getSOC() - 50) < 0.1f);
+}
+
+//----------------------------------------------------------------------------
+// SOC reset of the driver must not be taken as charge by the estimator (flat
+// OCV curve in the middle, so that the voltage correction is negligible)
+
+static const int16_t ocvTemperatures[] = { 250 };
+static const uint16_t ocvSoc[] = { 0, 1000, 3000, 7000, 9000, 10000 };
+static const uint16_t ocvVoltages[] = { 3000, 3250, 3300, 3320, 3350, 3600 };
+static const OcvTable ocvTable = { 1, 6, ocvTemperatures, ocvSoc, ocvVoltages };
+
+static void testSocReset(void)
+{
+    TestSetup t(bq76940);
+    bq769x0Soc soc(ocvTable, 10000);
+
+    t.bms.setBatteryCapacity(10000);
+    t.bms.attachSocEstimator(&soc);
+    t.sim.setCellVoltages(3310);
+    t.run(2);
+    float initial = soc.getSOC();
+    check("SOC reset", "estimator initialized", soc.isInitialized() && initial > 40 && initial < 60);
+
+    t.bms.resetSOC(-1);     // coulomb counter from estimator
+    t.run(1);
+    check("SOC reset", "estimator kept after automatic reset", fabsf(soc.getSOC() - initial) < 0.5f);
+    check("SOC reset", "coulomb counter set", fabsf(t.bms.getSOC() - initial) < 0.5f);
+
+    t.bms.resetSOC(60);
+    t.run(1);
+    check("SOC reset", "estimator reset to known SOC", fabsf(soc.getSOC() - 60) < 0.5f);
+}
+
+//----------------------------------------------------------------------------
+// two ICs with the same address behind an I2C mux: accesses outside of the
+// stack update must reach the IC of the driver
+
+struct HostI2CMux : HostI2CDevice {
+    bq769x0Sim *channels[2];
+    int channel;
+
+    void selectFirst(void) { channel = 0; }
+    void selectSecond(void) { channel = 1; }
+
+    int write(int address, const char *data, int length)
+    {
+        return channels[channel]->write(address, data, length);
+    }
+
+    int read(int address, char *data, int length)
+    {
+        return channels[channel]->read(address, data, length);
+    }
+};
+
+static void testStackMux(void)
+{
+    I2C i2c(1, 2);
+    I2C unused(NC, NC);     // only for the ALERT pins of the simulated ICs
+    bq769x0Sim simFirst(bq76940);
+    bq769x0Sim simSecond(bq76940);
+    HostI2CMux mux;
+
+    simFirst.connect(unused, ALERT_PIN);
+    simSecond.connect(unused, ALERT_PIN + 1);
+    mux.channels[0] = &simFirst;
+    mux.channels[1] = &simSecond;
+    i2c.attachDevice(&mux);
+
+    mux.selectFirst();
+    bq769x0 first(i2c, ALERT_PIN, bq76940);
+    mux.selectSecond();
+    bq769x0 second(i2c, ALERT_PIN + 1, bq76940);
+
+    bq769x0Stack stack;
+    stack.addDevice(first, callback(&mux, &HostI2CMux::selectFirst));
+    stack.addDevice(second, callback(&mux, &HostI2CMux::selectSecond));
+
+    bq769x0* devices[] = { &first, &second };
+    for (int i = 0; i < 2; i++) {
+        devices[i]->setShuntResistorValue(SHUNT_MOHM);
+        devices[i]->setTemperatureLimits(-20, 60, 0, 45);
+        devices[i]->setCellOvervoltageProtection(4200, 2);
+        devices[i]->setCellUndervoltageProtection(2900, 2);
+    }
+    for (int i = 0; i < 8; i++) {
+        wait_ms(250);
+        stack.update();
+    }
+    first.enableDischarging();
+    second.enableDischarging();
+    check("stack mux", "FETs enabled", (simFirst.getRegister(SYS_CTRL2) & FET_DSG) &&
+        (simSecond.getRegister(SYS_CTRL2) & FET_DSG));
+
+    first.disableDischarging();     // last stack access selected the second IC
+    check("stack mux", "FET of selected IC switched", (simFirst.getRegister(SYS_CTRL2) & FET_DSG) == 0 &&
+        (simSecond.getRegister(SYS_CTRL2) & FET_DSG));
+
+    simSecond.injectFault(STAT_DEVICE_XREADY);
+    stack.update();
+    first.checkStatus();
+    check("stack mux", "fault of correct IC", second.checkStatus() == STAT_DEVICE_XREADY &&
+        first.checkStatus() == 0);
+}
+
+//----------------------------------------------------------------------------
+
+int main()
+{
+    benchmark(bq76920, 5);
+    benchmark(bq76930, 10);
+    benchmark(bq76940, 15);
+
+    testVoltageFault("UV", 2500, STAT_UV, FET_DSG);
+    testVoltageFault("OV", 4300, STAT_OV, FET_CHG);
+    testCurrentFault("SCD", -60000, STAT_SCD, FET_DSG);
+    testCurrentFault("OCD", -25000, STAT_OCD, FET_DSG);
+    testCurrentFault("OCC", 8000, BQ769X0_ERR_OCC, FET_CHG);
+    testXready();
+    testUndervoltageAndOcc();
+    testFailedClear();
+    testBusErrors();
+    testSocReset();
+
+    testCoulombCounter(100);
+    testCoulombCounter(200);
+    testCoulombCounter(250);
+    testCoulombCounter(300);
+    testCoulombCounter(400);
+    testCoulombCounter(600);
+    testEarlySocReset();
+    testStackMux();
+    testBalancingWindow();
+    testDiagFrame();
+    testMissingTemperature();
+
+    printf("%s (%d failures)\n", failures ? "FAILED" : "PASSED", failures);
+    return failures ? 1 : 0;
+}
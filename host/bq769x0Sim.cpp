@@ -0,0 +1,556 @@
+/* Battery management system based on bq769x0 for ARM mbed
+ * Copyright (c) 2015-2018 Martin Jäger (www.libre.solar)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "bq769x0Sim.h"
+#include "registers.h"
+
+#define CONVERSION_PERIOD_US 250000
+#define CC_LSB_NV 8440              // nV/LSB of coulomb counter
+#define TS_LSB_UV 382               // uV/LSB of thermistor ADC
+
+static uint8_t crc8(uint8_t crc, uint8_t data)
+{
+    crc ^= data;
+    for (int i = 0; i < 8; i++) {
+        crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : (crc << 1);
+    }
+    return crc;
+}
+
+//----------------------------------------------------------------------------
+
+bq769x0Sim::bq769x0Sim(int bqType, int address, bool crc)
+{
+    type = bqType;
+    numberOfCells = (type == bq76920) ? 5 : (type == bq76930) ? 10 : 15;
+    i2cAddress = address;
+    crcEnabled = crc;
+    alert = NC;
+
+    for (int i = 0; i < MAX_NUMBER_OF_CELLS; i++) {
+        cellVoltages[i] = (i < numberOfCells) ? 3600 : 0;
+    }
+    shuntVoltage = 0;
+    balancingDrop = 0;
+    adcGain = 380;
+    adcOffset = 30;
+    for (int i = 1; i <= MAX_NUMBER_OF_THERMISTORS; i++) {
+        setTemperature(i, 25);
+    }
+
+    nackCount = 0;
+    writeNackAddress = 0;
+    writeNackCount = 0;
+    crcErrorCount = 0;
+    crcErrorByte = 0;
+    resetStatistics();
+
+    conversionEvent.handler = callback(this, &bq769x0Sim::conversion);
+    protectionEvent.handler = callback(this, &bq769x0Sim::checkCurrentProtection);
+
+    booted = false;
+    boot();
+}
+
+//----------------------------------------------------------------------------
+
+bq769x0Sim::~bq769x0Sim()
+{
+    HostTime::cancel(&conversionEvent);
+    HostTime::cancel(&protectionEvent);
+}
+
+//----------------------------------------------------------------------------
+
+void bq769x0Sim::connect(I2C& i2c, PinName alertPin)
+{
+    i2c.attachDevice(this);
+    alert = alertPin;
+}
+
+//----------------------------------------------------------------------------
+
+void bq769x0Sim::reset()
+{
+    memset(reg, 0, sizeof(reg));
+    memset(balancingCycle, 0, sizeof(balancingCycle));
+    setAdcCalibration(adcGain, adcOffset);
+    pointer = 0;
+    shutA = false;
+    ovTime_ms = 0;
+    uvTime_ms = 0;
+    scdActive = false;
+    ocdActive = false;
+    convertVoltages();
+}
+
+//----------------------------------------------------------------------------
+
+void bq769x0Sim::boot()
+{
+    if (!booted) {
+        reset();
+        booted = true;
+        HostTime::schedule(&conversionEvent, HostTime::read_us() + CONVERSION_PERIOD_US);
+    }
+}
+
+//----------------------------------------------------------------------------
+
+bool bq769x0Sim::isBooted()
+{
+    return booted;
+}
+
+//----------------------------------------------------------------------------
+
+void bq769x0Sim::setCellVoltage(int idCell, int voltage_mV)
+{
+    if (idCell >= 1 && idCell <= numberOfCells) {
+        cellVoltages[idCell - 1] = voltage_mV;
+    }
+}
+
+//----------------------------------------------------------------------------
+
+void bq769x0Sim::setCellVoltages(int voltage_mV)
+{
+    for (int i = 1; i <= numberOfCells; i++) {
+        setCellVoltage(i, voltage_mV);
+    }
+}
+
+//----------------------------------------------------------------------------
+
+void bq769x0Sim::setCurrent(long current_mA, float shunt_mOhm)
+{
+    shuntVoltage = current_mA * shunt_mOhm;
+    checkCurrentProtection();
+}
+
+//----------------------------------------------------------------------------
+
+void bq769x0Sim::setTemperature(int channel, float degC, int beta_K)
+{
+    if (channel < 1 || channel > MAX_NUMBER_OF_THERMISTORS) {
+        return;
+    }
+
+    // 10k NTC with 10k pull-up to 3.3 V (see datasheet)
+    float rts = 10000.0 * exp(beta_K * (1.0 / (degC + 273.15) - 1.0 / 298.15));
+    float vts = 3.3 * rts / (10000.0 + rts);
+    int adc = vts * 1e6 / TS_LSB_UV;
+
+    thermistorAdc[channel - 1] = (adc > 0x3FFF) ? 0x3FFF : adc;
+}
+
+//----------------------------------------------------------------------------
+
+void bq769x0Sim::setBalancingVoltageDrop(int voltage_mV)
+{
+    balancingDrop = voltage_mV;
+}
+
+//----------------------------------------------------------------------------
+
+void bq769x0Sim::setAdcCalibration(int gain_uV, int offset_mV)
+{
+    adcGain = gain_uV;
+    adcOffset = offset_mV;
+
+    int code = gain_uV - 365;
+    reg[ADCGAIN1] = (code >> 1) & 0x0C;
+    reg[ADCGAIN2] = (code << 5) & 0xE0;
+    reg[ADCOFFSET] = (int8_t)offset_mV;
+}
+
+//----------------------------------------------------------------------------
+
+void bq769x0Sim::injectFault(int statFlags)
+{
+    setFault(statFlags & STAT_FLAGS);
+}
+
+//----------------------------------------------------------------------------
+
+void bq769x0Sim::injectNack(int transactions)
+{
+    nackCount = transactions;
+}
+
+//----------------------------------------------------------------------------
+
+void bq769x0Sim::injectWriteNack(int address, int writes)
+{
+    writeNackAddress = address;
+    writeNackCount = writes;
+}
+
+//----------------------------------------------------------------------------
+
+void bq769x0Sim::injectCrcError(int reads, int byteIndex)
+{
+    crcErrorCount = reads;
+    crcErrorByte = byteIndex;
+}
+
+//----------------------------------------------------------------------------
+
+int bq769x0Sim::getRegister(int address)
+{
+    if (address >= 0 && address < BQ769X0_SIM_NUM_REGISTERS) {
+        return reg[address];
+    }
+    return -1;
+}
+
+//----------------------------------------------------------------------------
+
+void bq769x0Sim::setRegister(int address, int value)
+{
+    if (address >= 0 && address < BQ769X0_SIM_NUM_REGISTERS) {
+        reg[address] = value;
+    }
+}
+
+//----------------------------------------------------------------------------
+
+unsigned long bq769x0Sim::getTransactions()
+{
+    return transactions;
+}
+
+//----------------------------------------------------------------------------
+
+unsigned long bq769x0Sim::getBytes()
+{
+    return bytes;
+}
+
+//----------------------------------------------------------------------------
+
+void bq769x0Sim::resetStatistics()
+{
+    transactions = 0;
+    bytes = 0;
+}
+
+//----------------------------------------------------------------------------
+// register pointer followed by data, with CRC if enabled:
+// reg, data, CRC(address, reg, data), [data, CRC(data)], ...
+// (data with wrong CRC is ignored)
+
+int bq769x0Sim::write(int address, const char *data, int length)
+{
+    if ((address >> 1) != i2cAddress || !booted) {
+        return 1;
+    }
+    transactions++;
+    bytes += length + 1;
+
+    if (nackCount > 0) {
+        nackCount--;
+        return 1;
+    }
+    if (length < 1) {
+        return 0;
+    }
+    if (writeNackCount > 0 && length > 1 && (uint8_t)data[0] == writeNackAddress) {
+        writeNackCount--;
+        return 1;       // data byte not acknowledged
+    }
+
+    pointer = (uint8_t)data[0];
+
+    if (crcEnabled) {
+        for (int i = 1; i + 1 < length; i += 2) {
+            uint8_t crc = (i == 1) ? crc8(crc8(crc8(0, address), data[0]), data[1]) : crc8(0, data[i]);
+            if (crc != (uint8_t)data[i + 1]) {
+                break;
+            }
+            writeRegister(pointer++, data[i]);
+        }
+    }
+    else {
+        for (int i = 1; i < length; i++) {
+            writeRegister(pointer++, data[i]);
+        }
+    }
+    return 0;
+}
+
+//----------------------------------------------------------------------------
+// data from register pointer with auto-increment, with CRC if enabled:
+// data, CRC(address, data), [data, CRC(data)], ...
+
+int bq769x0Sim::read(int address, char *data, int length)
+{
+    if ((address >> 1) != i2cAddress || !booted) {
+        return 1;
+    }
+    transactions++;
+    bytes += length + 1;
+
+    if (nackCount > 0) {
+        nackCount--;
+        return 1;
+    }
+
+    if (crcEnabled) {
+        for (int i = 0; i + 1 < length; i += 2) {
+            uint8_t value = reg[pointer++ % BQ769X0_SIM_NUM_REGISTERS];
+            data[i] = value;
+            data[i + 1] = (i == 0) ? crc8(crc8(0, address), value) : crc8(0, value);
+        }
+        if (crcErrorCount > 0 && crcErrorByte * 2 + 1 < length) {
+            crcErrorCount--;
+            data[crcErrorByte * 2 + 1] ^= 0x01;
+        }
+    }
+    else {
+        for (int i = 0; i < length; i++) {
+            data[i] = reg[pointer++ % BQ769X0_SIM_NUM_REGISTERS];
+        }
+    }
+    return 0;
+}
+
+//----------------------------------------------------------------------------
+
+void bq769x0Sim::writeRegister(int address, uint8_t value)
+{
+    if (address == SYS_STAT) {
+        reg[SYS_STAT] &= ~value;    // write 1 to clear
+        checkCurrentProtection();   // condition may still be present
+    }
+    else if (address == SYS_CTRL1) {
+        // shutdown sequence: SHUT_A = 0, SHUT_B = 1 followed by SHUT_A = 1, SHUT_B = 0
+        if ((value & 0x03) == 0x02 && shutA) {
+            booted = false;
+            HostTime::cancel(&conversionEvent);
+            HostTime::cancel(&protectionEvent);
+            return;
+        }
+        shutA = (value & 0x03) == 0x01;
+        reg[SYS_CTRL1] = (reg[SYS_CTRL1] & 0x80) | (value & 0x18);  // LOAD_PRESENT read-only
+    }
+    else if (address == SYS_CTRL2) {
+        // FETs can't be switched on before the fault is cleared
+        uint8_t stat = reg[SYS_STAT];
+        if (stat & (STAT_DEVICE_XREADY | STAT_OVRD_ALERT | STAT_OV)) {
+            value &= ~0x01;
+        }
+        if (stat & (STAT_DEVICE_XREADY | STAT_OVRD_ALERT | STAT_UV | STAT_SCD | STAT_OCD)) {
+            value &= ~0x02;
+        }
+        reg[SYS_CTRL2] = value;
+        checkCurrentProtection();
+    }
+    else if (address >= CELLBAL1 && address <= CC_CFG) {
+        reg[address] = value;
+        if (address < CELLBAL1 + BQ769X0_SIM_NUM_SECTIONS) {
+            balancingCycle[address - CELLBAL1] |= value;
+        }
+        if (address == PROTECT1 || address == PROTECT2) {
+            checkCurrentProtection();
+        }
+    }
+    // other registers are read-only
+}
+
+//----------------------------------------------------------------------------
+// ADC and CC conversion cycle
+
+void bq769x0Sim::conversion()
+{
+    HostTime::schedule(&conversionEvent, conversionEvent.time_us + CONVERSION_PERIOD_US);
+
+    if (reg[SYS_CTRL1] & 0x10) {    // ADC_EN
+        convertVoltages();
+        checkVoltageProtection();
+    }
+
+    if (reg[SYS_CTRL2] & 0x60) {    // CC_EN or CC_ONESHOT
+        int cc = shuntVoltage * 1000 / CC_LSB_NV;
+        cc = (cc > 32767) ? 32767 : ((cc < -32768) ? -32768 : cc);
+        reg[CC_HI_BYTE] = HIGH_BYTE(cc);
+        reg[CC_LO_BYTE] = LOW_BYTE(cc);
+        reg[SYS_CTRL2] &= ~0x20;    // CC_ONESHOT cleared after conversion
+        reg[SYS_STAT] |= STAT_CC_READY;
+        raiseAlert();
+    }
+}
+
+//----------------------------------------------------------------------------
+
+void bq769x0Sim::convertVoltages()
+{
+    long sum = 0;
+    int cells = 0;
+
+    for (int i = 0; i < MAX_NUMBER_OF_CELLS; i++) {
+        int voltage = cellVoltages[i];
+        if (voltage > 500) {
+            sum += voltage;
+            cells++;
+        }
+        if (balancingCycle[i / 5] & (1 << (i % 5))) {
+            voltage -= balancingDrop;
+        }
+        int adc = (voltage - adcOffset) * 1000 / adcGain;
+        adc = (adc < 0) ? 0 : ((adc > 0x3FFF) ? 0x3FFF : adc);
+        reg[VC1_HI_BYTE + i * 2] = HIGH_BYTE(adc);
+        reg[VC1_LO_BYTE + i * 2] = LOW_BYTE(adc);
+    }
+
+    long adc = (sum - cells * adcOffset) * 1000 / (4 * adcGain);
+    reg[BAT_HI_BYTE] = HIGH_BYTE(adc);
+    reg[BAT_LO_BYTE] = LOW_BYTE(adc);
+
+    for (int i = 0; i < MAX_NUMBER_OF_THERMISTORS; i++) {
+        reg[TS1_HI_BYTE + i * 2] = HIGH_BYTE(thermistorAdc[i]);
+        reg[TS1_LO_BYTE + i * 2] = LOW_BYTE(thermistorAdc[i]);
+    }
+
+    // switches on at the start of the next cycle
+    for (int i = 0; i < BQ769X0_SIM_NUM_SECTIONS; i++) {
+        balancingCycle[i] = reg[CELLBAL1 + i];
+    }
+}
+
+//----------------------------------------------------------------------------
+// OV and UV comparators, evaluated with each ADC conversion
+
+void bq769x0Sim::checkVoltageProtection()
+{
+    int ovAdc = 0x2008 | (reg[OV_TRIP] << 4);
+    int uvAdc = 0x1000 | (reg[UV_TRIP] << 4);
+    bool ov = false;
+    bool uv = false;
+
+    for (int i = 0; i < numberOfCells; i++) {
+        int adc = (reg[VC1_HI_BYTE + i * 2] & 0x3F) << 8 | reg[VC1_LO_BYTE + i * 2];
+        if (adc > ovAdc) {
+            ov = true;
+        }
+        if (adc < uvAdc && cellVoltages[i] > 500) {     // shorted cells ignored
+            uv = true;
+        }
+    }
+
+    bool delayDisabled = reg[SYS_CTRL2] & 0x80;
+    int ovDelay = delayDisabled ? 0 : OV_delay_setting[(reg[PROTECT3] >> 4) & 0x03] * 1000;
+    int uvDelay = delayDisabled ? 0 : UV_delay_setting[(reg[PROTECT3] >> 6) & 0x03] * 1000;
+
+    ovTime_ms = ov ? ovTime_ms + CONVERSION_PERIOD_US / 1000 : 0;
+    uvTime_ms = uv ? uvTime_ms + CONVERSION_PERIOD_US / 1000 : 0;
+
+    if (ov && ovTime_ms >= ovDelay && !(reg[SYS_STAT] & STAT_OV)) {
+        setFault(STAT_OV);
+    }
+    if (uv && uvTime_ms >= uvDelay && !(reg[SYS_STAT] & STAT_UV)) {
+        setFault(STAT_UV);
+    }
+}
+
+//----------------------------------------------------------------------------
+
+int bq769x0Sim::scdThreshold()
+{
+    int mV = SCD_threshold_setting[reg[PROTECT1] & 0x07];
+    return (reg[PROTECT1] & 0x80) ? mV * 1000 : mV * 500;     // RSNS = 0: half range
+}
+
+//----------------------------------------------------------------------------
+
+int bq769x0Sim::ocdThreshold()
+{
+    int mV = OCD_threshold_setting[reg[PROTECT2] & 0x0F];
+    return (reg[PROTECT1] & 0x80) ? mV * 1000 : mV * 500;
+}
+
+//----------------------------------------------------------------------------
+// SCD and OCD comparators for discharge current with exact delay
+
+void bq769x0Sim::checkCurrentProtection()
+{
+    uint64_t now = HostTime::read_us();
+    uint64_t next = 0;
+
+    bool scd = (reg[SYS_CTRL2] & 0x02) && -shuntVoltage >= scdThreshold();
+    if (scd && !scdActive) {
+        scdStart = now;
+    }
+    scdActive = scd;
+    if (scdActive) {
+        uint64_t due = scdStart + SCD_delay_setting[(reg[PROTECT1] >> 3) & 0x03];
+        if (now >= due) {
+            setFault(STAT_SCD);     // switches DSG off, so OCD is stopped as well
+            scdActive = false;
+        }
+        else {
+            next = due;
+        }
+    }
+
+    bool ocd = (reg[SYS_CTRL2] & 0x02) && -shuntVoltage >= ocdThreshold();
+    if (ocd && !ocdActive) {
+        ocdStart = now;
+    }
+    ocdActive = ocd;
+    if (ocdActive) {
+        uint64_t due = ocdStart + OCD_delay_setting[(reg[PROTECT2] >> 4) & 0x07] * 1000;
+        if (now >= due) {
+            setFault(STAT_OCD);
+            ocdActive = false;
+        }
+        else if (next == 0 || due < next) {
+            next = due;
+        }
+    }
+
+    if (next > 0) {
+        HostTime::schedule(&protectionEvent, next);
+    }
+    else {
+        HostTime::cancel(&protectionEvent);
+    }
+}
+
+//----------------------------------------------------------------------------
+// sets fault flags and switches the affected FETs off like the IC
+
+void bq769x0Sim::setFault(int statFlags)
+{
+    if (statFlags & (STAT_DEVICE_XREADY | STAT_OVRD_ALERT | STAT_OV)) {
+        reg[SYS_CTRL2] &= ~0x01;
+    }
+    if (statFlags & (STAT_DEVICE_XREADY | STAT_OVRD_ALERT | STAT_UV | STAT_SCD | STAT_OCD)) {
+        reg[SYS_CTRL2] &= ~0x02;
+    }
+    reg[SYS_STAT] |= statFlags;
+    raiseAlert();
+}
+
+//----------------------------------------------------------------------------
+
+void bq769x0Sim::raiseAlert()
+{
+    if (alert != NC) {
+        InterruptIn::trigger(alert);
+    }
+}
@@ -0,0 +1,136 @@
+/* Battery management system based on bq769x0 for ARM mbed
+ * Copyright (c) 2015-2018 Martin Jäger (www.libre.solar)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef BQ769X0SIM_H
+#define BQ769X0SIM_H
+
+#include "mbed.h"
+#include "bq769x0.h"
+
+#define BQ769X0_SIM_NUM_REGISTERS 0x5A
+#define BQ769X0_SIM_NUM_SECTIONS (MAX_NUMBER_OF_CELLS / 5)     // CELLBAL registers
+
+// Register-level simulation of a bq769x0 IC on the host I2C bus
+//
+// Implemented behaviour:
+// - address and CRC (incl. retained register pointer and auto-increment)
+// - read-only measurement registers, write-1-to-clear SYS_STAT
+// - ADC and coulomb counter conversions every 250 ms with CC_READY and
+//   ALERT pin (CC_EN or CC_ONESHOT, ADC_EN)
+// - OV/UV protection with thresholds and delays from the registers, SCD/OCD
+//   based on the shunt voltage, FETs switched off by faults
+// - shutdown with SHUT_A/SHUT_B sequence and boot
+//
+// Faults which are not modelled (XR, OVRD_ALERT) and bus errors (NACK, wrong
+// CRC) can be injected. Timing of the comparators is limited to the 250 ms
+// conversion cycle, except SCD/OCD which use the exact delay.
+
+class bq769x0Sim : public HostI2CDevice {
+
+public:
+
+    bq769x0Sim(int type = bq76930, int address = 0x08, bool crc = true);
+    ~bq769x0Sim();
+
+    // attaches to the bus and the pin connected to ALERT of the driver
+    void connect(I2C& i2c, PinName alertPin);
+
+    // power-on via TS1 pin (all registers reset) and shutdown state
+    void boot(void);
+    bool isBooted(void);
+
+    // analog inputs
+    void setCellVoltage(int idCell, int voltage_mV);    // from 1 to number of cells
+    void setCellVoltages(int voltage_mV);
+    void setCurrent(long current_mA, float shunt_mOhm); // positive for charging
+    void setTemperature(int channel, float degC, int beta_K = 3435);    // channel from 1
+    void setBalancingVoltageDrop(int voltage_mV);       // measurement error of balanced cells
+                                                        // (switch on during conversion cycle)
+
+    // factory calibration (ADC gain 365-396 uV/LSB)
+    void setAdcCalibration(int gain_uV, int offset_mV);
+
+    // fault and error injection
+    void injectFault(int statFlags);        // STAT_* bits, e.g. STAT_DEVICE_XREADY
+    void injectNack(int transactions);
+    void injectWriteNack(int address, int writes);     // only writes to this register
+    void injectCrcError(int reads, int byteIndex = 0);
+
+    int getRegister(int address);
+    void setRegister(int address, int value);   // no side effects
+
+    // bus statistics
+    unsigned long getTransactions(void);
+    unsigned long getBytes(void);       // incl. address bytes
+    void resetStatistics(void);
+
+    // HostI2CDevice
+    int write(int address, const char *data, int length);
+    int read(int address, char *data, int length);
+
+private:
+
+    int type;
+    int numberOfCells;
+    int i2cAddress;
+    bool crcEnabled;
+    PinName alert;
+
+    uint8_t reg[BQ769X0_SIM_NUM_REGISTERS];
+    int pointer;
+    bool booted;
+    bool shutA;         // first step of shutdown sequence received
+
+    int cellVoltages[MAX_NUMBER_OF_CELLS];  // mV
+    long shuntVoltage;                      // uV
+    int thermistorAdc[MAX_NUMBER_OF_THERMISTORS];
+    int balancingDrop;
+    uint8_t balancingCycle[BQ769X0_SIM_NUM_SECTIONS];   // CELLBAL bits set in conversion cycle
+    int adcGain;
+    int adcOffset;
+
+    int ovTime_ms;      // time with active OV condition
+    int uvTime_ms;
+    bool scdActive;     // SCD/OCD condition present, waiting for delay
+    bool ocdActive;
+    uint64_t scdStart;  // us
+    uint64_t ocdStart;
+
+    int nackCount;
+    int writeNackAddress;
+    int writeNackCount;
+    int crcErrorCount;
+    int crcErrorByte;
+    unsigned long transactions;
+    unsigned long bytes;
+
+    HostEvent conversionEvent;
+    HostEvent protectionEvent;
+
+    void reset(void);
+    void writeRegister(int address, uint8_t value);
+    void conversion(void);
+    void convertVoltages(void);
+    void checkVoltageProtection(void);
+    void checkCurrentProtection(void);
+    void setFault(int statFlags);
+    void raiseAlert(void);
+    int scdThreshold(void);     // uV
+    int ocdThreshold(void);
+};
+
+#endif // BQ769X0SIM_H
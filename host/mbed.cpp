@@ -0,0 +1,249 @@
+/* Battery management system based on bq769x0 for ARM mbed
+ * Copyright (c) 2015-2018 Martin Jäger (www.libre.solar)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "mbed.h"
+
+uint64_t HostTime::now = 0;
+HostEvent *HostTime::events = NULL;
+
+InterruptIn *InterruptIn::instances = NULL;
+
+//----------------------------------------------------------------------------
+
+uint64_t HostTime::read_us()
+{
+    return now;
+}
+
+//----------------------------------------------------------------------------
+
+void HostTime::advance(uint64_t time_us)
+{
+    uint64_t end = now + time_us;
+
+    while (events != NULL && events->time_us <= end) {
+        HostEvent *event = events;
+        events = event->next;
+        event->scheduled = false;
+        if (event->time_us > now) {
+            now = event->time_us;
+        }
+        event->handler();   // may re-schedule the event
+    }
+
+    if (end > now) {
+        now = end;
+    }
+}
+
+//----------------------------------------------------------------------------
+
+void HostTime::schedule(HostEvent *event, uint64_t time_us)
+{
+    cancel(event);
+
+    event->time_us = time_us;
+    event->scheduled = true;
+
+    HostEvent **pos = &events;
+    while (*pos != NULL && (*pos)->time_us <= time_us) {
+        pos = &(*pos)->next;
+    }
+    event->next = *pos;
+    *pos = event;
+}
+
+//----------------------------------------------------------------------------
+
+void HostTime::cancel(HostEvent *event)
+{
+    if (!event->scheduled) {
+        return;
+    }
+
+    for (HostEvent **pos = &events; *pos != NULL; pos = &(*pos)->next) {
+        if (*pos == event) {
+            *pos = event->next;
+            break;
+        }
+    }
+    event->scheduled = false;
+}
+
+//----------------------------------------------------------------------------
+
+void Timer::start()
+{
+    if (!running) {
+        startTime = HostTime::read_us();
+        running = true;
+    }
+}
+
+//----------------------------------------------------------------------------
+
+void Timer::stop()
+{
+    if (running) {
+        elapsed += HostTime::read_us() - startTime;
+        running = false;
+    }
+}
+
+//----------------------------------------------------------------------------
+
+void Timer::reset()
+{
+    startTime = HostTime::read_us();
+    elapsed = 0;
+}
+
+//----------------------------------------------------------------------------
+
+us_timestamp_t Timer::read_high_resolution_us()
+{
+    return elapsed + (running ? HostTime::read_us() - startTime : 0);
+}
+
+//----------------------------------------------------------------------------
+
+void Timeout::attach_us(Callback<void()> func, us_timestamp_t t)
+{
+    event.handler = func;
+    HostTime::schedule(&event, HostTime::read_us() + t);
+}
+
+//----------------------------------------------------------------------------
+
+InterruptIn::InterruptIn(PinName pinName)
+{
+    pin = pinName;
+    next = instances;
+    instances = this;
+}
+
+//----------------------------------------------------------------------------
+
+InterruptIn::~InterruptIn()
+{
+    for (InterruptIn **pos = &instances; *pos != NULL; pos = &(*pos)->next) {
+        if (*pos == this) {
+            *pos = next;
+            break;
+        }
+    }
+}
+
+//----------------------------------------------------------------------------
+
+void InterruptIn::trigger(PinName pin, bool rising)
+{
+    for (InterruptIn *irq = instances; irq != NULL; irq = irq->next) {
+        Callback<void()>& handler = rising ? irq->riseHandler : irq->fallHandler;
+        if (irq->pin == pin && handler) {
+            handler();
+        }
+    }
+}
+
+//----------------------------------------------------------------------------
+
+I2C::I2C(PinName sda, PinName scl)
+{
+    (void)sda;
+    (void)scl;
+    numberOfDevices = 0;
+    frequency_hz = 100000;
+}
+
+//----------------------------------------------------------------------------
+
+void I2C::frequency(int hz)
+{
+    frequency_hz = hz;
+}
+
+//----------------------------------------------------------------------------
+
+bool I2C::attachDevice(HostI2CDevice *device)
+{
+    if (numberOfDevices >= HOST_I2C_MAX_DEVICES) {
+        return false;
+    }
+    devices[numberOfDevices++] = device;
+    return true;
+}
+
+//----------------------------------------------------------------------------
+// advances the simulated time by the duration of a transfer incl. address
+// byte and start/stop condition (9 clock cycles per byte)
+
+void I2C::transferTime(int bytes)
+{
+    HostTime::advance(((uint64_t)(bytes + 1) * 9 + 2) * 1000000 / frequency_hz);
+}
+
+//----------------------------------------------------------------------------
+
+int I2C::write(int address, const char *data, int length, bool repeated)
+{
+    (void)repeated;
+    transferTime(length);
+
+    for (int i = 0; i < numberOfDevices; i++) {
+        if (devices[i]->write(address & ~1, data, length) == 0) {
+            return 0;
+        }
+    }
+    return 1;   // NACK
+}
+
+//----------------------------------------------------------------------------
+
+int I2C::read(int address, char *data, int length, bool repeated)
+{
+    (void)repeated;
+    transferTime(length);
+
+    for (int i = 0; i < numberOfDevices; i++) {
+        if (devices[i]->read(address | 1, data, length) == 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+//----------------------------------------------------------------------------
+
+int I2C::transfer(int address, const char *tx_buffer, int tx_length, char *rx_buffer, int rx_length,
+    const event_callback_t& callback, int event, bool repeated)
+{
+    int ret = 0;
+
+    if (tx_length > 0) {
+        ret = write(address, tx_buffer, tx_length, rx_length > 0 || repeated);
+    }
+    if (ret == 0 && rx_length > 0) {
+        ret = read(address, rx_buffer, rx_length, repeated);
+    }
+
+    int result = (ret == 0) ? I2C_EVENT_TRANSFER_COMPLETE : I2C_EVENT_ERROR_NO_SLAVE;
+    if (callback && (result & event)) {
+        callback(result);
+    }
+    return 0;
+}
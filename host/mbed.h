@@ -0,0 +1,313 @@
+/* Battery management system based on bq769x0 for ARM mbed
+ * Copyright (c) 2015-2018 Martin Jäger (www.libre.solar)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef HOST_MBED_H
+#define HOST_MBED_H
+
+// Minimal implementation of the mbed OS API used by the driver, so that it
+// can be compiled and run on a desktop computer together with a simulated IC
+// (see bq769x0Sim.h). This directory replaces mbed OS in the include path,
+// and char is unsigned like on ARM:
+//
+//     g++ -funsigned-char -I host -I . bq769x0*.cpp host/mbed.cpp host/bq769x0Sim.cpp application.cpp
+//
+// host/benchmark.cpp can be used as application (bus load and fault handling).
+//
+// Time is simulated and only proceeds with the wait functions, I2C transfers
+// (according to the bus frequency) or HostTime::advance(). Timeouts and
+// simulated devices are called from there, like interrupts on the target.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+
+#define MBED_ASSERT(expr) assert(expr)
+
+typedef int PinName;
+#define NC (-1)
+
+#define DEVICE_I2C_ASYNCH 1
+
+#define I2C_EVENT_ERROR               (1 << 1)
+#define I2C_EVENT_ERROR_NO_SLAVE      (1 << 2)
+#define I2C_EVENT_TRANSFER_COMPLETE   (1 << 3)
+#define I2C_EVENT_TRANSFER_EARLY_NACK (1 << 4)
+#define I2C_EVENT_ALL (I2C_EVENT_ERROR | I2C_EVENT_TRANSFER_COMPLETE | \
+    I2C_EVENT_ERROR_NO_SLAVE | I2C_EVENT_TRANSFER_EARLY_NACK)
+
+typedef uint64_t us_timestamp_t;
+
+#define __DMB() __sync_synchronize()
+
+//----------------------------------------------------------------------------
+// function or member function pointer without heap allocation
+
+template <typename F>
+class Callback;
+
+template <typename R, typename... A>
+class Callback<R(A...)> {
+
+public:
+
+    Callback() : _obj(NULL), _thunk(NULL) {}
+
+    Callback(R (*func)(A...)) : _obj(NULL), _thunk(func ? &functionThunk : NULL)
+    {
+        memcpy(_method, &func, sizeof(func));
+    }
+
+    template <typename T, typename U>
+    Callback(U *obj, R (T::*method)(A...)) : _obj(static_cast<T*>(obj)), _thunk(&methodThunk<T>)
+    {
+        static_assert(sizeof(method) <= sizeof(_method), "member function pointer too large");
+        memcpy(_method, &method, sizeof(method));
+    }
+
+    R call(A... args) const { return _thunk(this, args...); }
+    R operator()(A... args) const { return _thunk(this, args...); }
+    operator bool() const { return _thunk != NULL; }
+
+private:
+
+    struct Dummy {};
+
+    void *_obj;
+    R (*_thunk)(const Callback*, A...);
+    union {
+        char _method[sizeof(void (Dummy::*)()) * 2];
+        void *_align;
+    };
+
+    static R functionThunk(const Callback *cb, A... args)
+    {
+        R (*func)(A...);
+        memcpy(&func, cb->_method, sizeof(func));
+        return func(args...);
+    }
+
+    template <typename T>
+    static R methodThunk(const Callback *cb, A... args)
+    {
+        R (T::*method)(A...);
+        memcpy(&method, cb->_method, sizeof(method));
+        return (static_cast<T*>(cb->_obj)->*method)(args...);
+    }
+};
+
+template <typename T, typename U, typename R, typename... A>
+Callback<R(A...)> callback(U *obj, R (T::*method)(A...))
+{
+    return Callback<R(A...)>(obj, method);
+}
+
+template <typename R, typename... A>
+Callback<R(A...)> callback(R (*func)(A...))
+{
+    return Callback<R(A...)>(func);
+}
+
+typedef Callback<void(int)> event_callback_t;
+
+//----------------------------------------------------------------------------
+// simulated time
+
+struct HostEvent {
+    Callback<void()> handler;
+    uint64_t time_us;
+    HostEvent *next;
+    bool scheduled;
+
+    HostEvent() : time_us(0), next(NULL), scheduled(false) {}
+};
+
+class HostTime {
+
+public:
+
+    static uint64_t read_us(void);
+
+    // runs all events up to now + time_us in chronological order
+    static void advance(uint64_t time_us);
+
+    static void schedule(HostEvent *event, uint64_t time_us);
+    static void cancel(HostEvent *event);
+
+private:
+
+    static uint64_t now;
+    static HostEvent *events;   // sorted by time
+};
+
+inline void wait_us(int us) { HostTime::advance(us); }
+inline void wait_ms(int ms) { HostTime::advance((uint64_t)ms * 1000); }
+inline void wait(float s) { HostTime::advance((uint64_t)(s * 1e6f)); }
+
+inline uint32_t us_ticker_read(void) { return (uint32_t)HostTime::read_us(); }
+
+class Timer {
+
+public:
+
+    Timer() : running(false), startTime(0), elapsed(0) {}
+
+    void start(void);
+    void stop(void);
+    void reset(void);
+    float read(void) { return read_high_resolution_us() / 1e6f; }
+    int read_ms(void) { return (int)(read_high_resolution_us() / 1000); }
+    int read_us(void) { return (int)read_high_resolution_us(); }
+    us_timestamp_t read_high_resolution_us(void);
+
+private:
+
+    bool running;
+    uint64_t startTime;
+    uint64_t elapsed;
+};
+
+class Timeout {
+
+public:
+
+    ~Timeout() { detach(); }
+
+    void attach_us(Callback<void()> func, us_timestamp_t t);
+    void attach(Callback<void()> func, float t) { attach_us(func, (us_timestamp_t)(t * 1e6f)); }
+    void detach(void) { HostTime::cancel(&event); }
+
+private:
+
+    HostEvent event;
+};
+
+//----------------------------------------------------------------------------
+// interrupts and critical sections (single-threaded on host)
+
+class CriticalSectionLock {
+public:
+    CriticalSectionLock() {}
+    ~CriticalSectionLock() {}
+};
+
+inline uint32_t core_util_atomic_incr_u32(volatile uint32_t *valuePtr, uint32_t delta)
+{
+    return __sync_add_and_fetch(valuePtr, delta);
+}
+
+//----------------------------------------------------------------------------
+// digital pins
+
+class InterruptIn {
+
+public:
+
+    InterruptIn(PinName pin);
+    ~InterruptIn();
+
+    void rise(Callback<void()> func) { riseHandler = func; }
+    void fall(Callback<void()> func) { fallHandler = func; }
+
+    // host only: simulates an edge at all InterruptIn objects of the pin
+    static void trigger(PinName pin, bool rising = true);
+
+private:
+
+    PinName pin;
+    Callback<void()> riseHandler;
+    Callback<void()> fallHandler;
+    InterruptIn *next;
+
+    static InterruptIn *instances;
+};
+
+// pins are not connected, reads return high level (pull-up of I2C bus)
+class DigitalInOut {
+
+public:
+
+    DigitalInOut(PinName pin) : level(1), isOutput(false) { (void)pin; }
+
+    void write(int value) { level = value; }
+    int read(void) { return isOutput ? level : 1; }
+    void output(void) { isOutput = true; }
+    void input(void) { isOutput = false; }
+    DigitalInOut& operator=(int value) { write(value); return *this; }
+    operator int() { return read(); }
+
+private:
+
+    int level;
+    bool isOutput;
+};
+
+struct PinMap {
+    PinName pin;
+    int peripheral;
+    int function;
+};
+
+inline const PinMap *i2c_master_sda_pinmap(void) { return NULL; }
+inline const PinMap *i2c_master_scl_pinmap(void) { return NULL; }
+inline void pinmap_pinout(PinName pin, const PinMap *map) { (void)pin; (void)map; }
+
+//----------------------------------------------------------------------------
+// I2C master connected to simulated devices
+
+class HostI2CDevice {
+
+public:
+
+    virtual ~HostI2CDevice() {}
+
+    // address incl. R/W bit, returns 0 if acknowledged by the device
+    virtual int write(int address, const char *data, int length) = 0;
+    virtual int read(int address, char *data, int length) = 0;
+};
+
+#define HOST_I2C_MAX_DEVICES 8
+
+class I2C {
+
+public:
+
+    I2C(PinName sda, PinName scl);
+
+    void frequency(int hz);
+    int read(int address, char *data, int length, bool repeated = false);
+    int write(int address, const char *data, int length, bool repeated = false);
+
+    // completes immediately, the callback is called before returning
+    int transfer(int address, const char *tx_buffer, int tx_length, char *rx_buffer, int rx_length,
+        const event_callback_t& callback, int event = I2C_EVENT_TRANSFER_COMPLETE, bool repeated = false);
+
+    // host only
+    bool attachDevice(HostI2CDevice *device);
+
+private:
+
+    HostI2CDevice *devices[HOST_I2C_MAX_DEVICES];
+    int numberOfDevices;
+    int frequency_hz;
+
+    void transferTime(int bytes);
+};
+
+#endif // HOST_MBED_H